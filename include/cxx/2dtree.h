@@ -3,8 +3,16 @@
 #include <memory>
 #include <vector>
 #include <algorithm>
+#include <iterator>
 #include <cxx/optimizer.h>
 #include <cxx/prims.h>
+#include <cxx/task_manager.h>
+#include <cxx/xstring.h>
+#include <cmath>
+#include <ostream>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 
 namespace cxx {
 
@@ -24,37 +32,284 @@ struct PayloadPoint
   PayloadPoint(double X = 0, double Y = 0, const T& pl=T()) : x(X), y(Y), payload(pl) {}
 };
 
-template<class POINT>
-class TwoDTree
+// Coordinate access used by the k-d trees.  Two dimensional points are read
+// through x/y, others through operator[].  Specialize for other point layouts.
+template<class P, int Dims>
+struct KDCoords
+{
+  typedef typename P::value_type value_type;
+  static value_type get(const P& p, int axe) { return p[axe]; }
+};
+
+template<class P>
+struct KDCoords<P,2>
+{
+  typedef typename P::value_type value_type;
+  static value_type get(const P& p, int axe) { return axe == 0 ? p.x : p.y; }
+};
+
+// Compile time unrolled loop, calling f(0) .. f(N-1)
+template<int N>
+struct KDUnroll
+{
+  template<class F>
+  static void apply(F& f) { KDUnroll<N-1>::apply(f); f(N-1); }
+};
+
+template<>
+struct KDUnroll<0>
+{
+  template<class F>
+  static void apply(F&) {}
+};
+
+// Distance kernel over coordinates stored per axis: adds (c[i]-q)^2 to d2[i] for i in [0,n).
+// float and double use AVX-512 or AVX2 when the target supports them.
+template<class T>
+inline void kd_accumulate_sqdiff(const T* c, T q, T* d2, size_t n)
+{
+  for (size_t i = 0; i < n; ++i)
+  {
+    T d = c[i] - q;
+    d2[i] += d*d;
+  }
+}
+
+#if defined(__AVX512F__)
+inline void kd_accumulate_sqdiff(const double* c, double q, double* d2, size_t n)
+{
+  __m512d vq = _mm512_set1_pd(q);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+  {
+    __m512d d = _mm512_sub_pd(_mm512_loadu_pd(c + i), vq);
+    _mm512_storeu_pd(d2 + i, _mm512_add_pd(_mm512_loadu_pd(d2 + i), _mm512_mul_pd(d, d)));
+  }
+  kd_accumulate_sqdiff<double>(c + i, q, d2 + i, n - i);
+}
+
+inline void kd_accumulate_sqdiff(const float* c, float q, float* d2, size_t n)
+{
+  __m512 vq = _mm512_set1_ps(q);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    __m512 d = _mm512_sub_ps(_mm512_loadu_ps(c + i), vq);
+    _mm512_storeu_ps(d2 + i, _mm512_add_ps(_mm512_loadu_ps(d2 + i), _mm512_mul_ps(d, d)));
+  }
+  kd_accumulate_sqdiff<float>(c + i, q, d2 + i, n - i);
+}
+#elif defined(__AVX2__)
+inline void kd_accumulate_sqdiff(const double* c, double q, double* d2, size_t n)
+{
+  __m256d vq = _mm256_set1_pd(q);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+  {
+    __m256d d = _mm256_sub_pd(_mm256_loadu_pd(c + i), vq);
+    _mm256_storeu_pd(d2 + i, _mm256_add_pd(_mm256_loadu_pd(d2 + i), _mm256_mul_pd(d, d)));
+  }
+  kd_accumulate_sqdiff<double>(c + i, q, d2 + i, n - i);
+}
+
+inline void kd_accumulate_sqdiff(const float* c, float q, float* d2, size_t n)
+{
+  __m256 vq = _mm256_set1_ps(q);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+  {
+    __m256 d = _mm256_sub_ps(_mm256_loadu_ps(c + i), vq);
+    _mm256_storeu_ps(d2 + i, _mm256_add_ps(_mm256_loadu_ps(d2 + i), _mm256_mul_ps(d, d)));
+  }
+  kd_accumulate_sqdiff<float>(c + i, q, d2 + i, n - i);
+}
+#endif
+
+// Cost counters of nearest neighbour searches.  Every search given a stats object
+// adds its costs to it, so the same object can hold one query or a whole workload.
+struct KDSearchStats
+{
+  KDSearchStats() { clear(); }
+
+  size_t queries;
+  size_t nodes;     // Nodes visited, leaves included
+  size_t leaves;    // Leaves (or buckets) tested
+  size_t pruned;    // Branches skipped by the distance bound
+  int    max_depth; // Deepest node visited
+
+  void clear()
+  {
+    queries = nodes = leaves = pruned = 0;
+    max_depth = 0;
+  }
+
+  void add(const KDSearchStats& rhs)
+  {
+    queries += rhs.queries;
+    nodes += rhs.nodes;
+    leaves += rhs.leaves;
+    pruned += rhs.pruned;
+    max_depth = std::max(max_depth, rhs.max_depth);
+  }
+};
+
+inline std::ostream& operator<< (std::ostream& os, const KDSearchStats& s)
+{
+  double n = double(std::max<size_t>(s.queries, 1));
+  return os << "Queries: " << s.queries << "  Nodes/query: " << s.nodes / n << "  Leaves/query: " << s.leaves / n 
+            << "  Pruned/query: " << s.pruned / n << "  Max depth: " << s.max_depth;
+}
+
+// Nearest neighbour search controls.  With eps > 0, a branch is only searched
+// if it may hold a point closer than best/(1+eps), so every reported distance is
+// within a factor of (1+eps) of the exact one.  A non zero max_leaves stops the
+// search after that many leaves (or buckets) were tested, bounding query latency.
+// When stats is set, the search costs are added to it.  A non zero bound is a
+// squared distance expected to hold the results, such as the one found for the
+// same query on the previous frame.  The search starts with it instead of an
+// unbounded distance, and is repeated without it when too few points lie within.
+struct KDSearchParams
+{
+  KDSearchParams(double e=0, size_t ml=0, KDSearchStats* st=0, double b=0) : eps(e), max_leaves(ml), stats(st), bound(b) {}
+  double         eps;
+  size_t         max_leaves;
+  KDSearchStats* stats;
+  double         bound;
+
+  // Initial bound of a search, just above the hinted one so points at that distance are kept
+  double initial_bound(double unbounded) const
+  {
+    return (bound > 0 && bound < unbounded ? std::nextafter(bound, unbounded) : unbounded);
+  }
+};
+
+// Running state of one search
+struct KDSearch
+{
+  KDSearch(const KDSearchParams& params)
+  : scale((1 + params.eps)*(1 + params.eps))
+  , budget(params.max_leaves > 0 ? params.max_leaves : std::numeric_limits<size_t>::max())
+  , leaves(0)
+  , stats(params.stats)
+  {
+    cost.queries = 1;
+  }
+
+  ~KDSearch()
+  {
+    if (stats)
+    {
+      cost.leaves = leaves;
+      stats->add(cost);
+    }
+  }
+
+  double         scale;
+  size_t         budget;
+  size_t         leaves;
+  KDSearchStats  cost;
+  KDSearchStats* stats;
+
+  bool exhausted() const { return leaves >= budget; }
+
+  void visit(int depth)
+  {
+    ++cost.nodes;
+    if (depth > cost.max_depth) cost.max_depth = depth;
+  }
+};
+
+// Neighbour graph in compressed sparse row form.  The neighbours of node i are
+// neighbors[offsets[i] .. offsets[i+1]), best first, with their squared distances
+// at the same positions in distances.
+struct KNNGraph
+{
+  std::vector<size_t> offsets;
+  std::vector<size_t> neighbors;
+  std::vector<double> distances;
+
+  size_t size() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+  size_t degree(size_t i) const { return offsets[i + 1] - offsets[i]; }
+};
+
+// Result counts above which searches keep their results in a HeapOptimizer, whose
+// O(log k) updates beat the sorted insertion of Optimizer for large k
+enum { KD_HEAP_K = 256 };
+
+// Size below which subtrees are handed to TaskManager workers by the parallel builds.
+// Keeps at least a few jobs per pool thread, without making tiny tasks.
+inline size_t kd_parallel_job_size(size_t n)
+{
+  size_t threads = std::max<size_t>(TaskManager::instance()->threads(), 1);
+  return std::max<size_t>(32768, n / (4 * threads));
+}
+
+template<int Dims, class P, class D=typename P::value_type>
+inline D kd_sqdist(const P& a, const P& b)
+{
+  typedef KDCoords<P,Dims> coords;
+  D sum = 0;
+  auto f = [&a, &b, &sum](int axe) { D d = coords::get(a, axe) - coords::get(b, axe); sum += d*d; };
+  KDUnroll<Dims>::apply(f);
+  return sum;
+}
+
+// k-d tree over points with Dims coordinates, cycling the split axis by depth
+template<class POINT, int Dims>
+class KDTree
 {
   typedef POINT point;
   typedef typename POINT::value_type value_type;
+  typedef KDCoords<POINT,Dims> coords;
 
   struct Node;
   typedef std::shared_ptr<Node> node_ptr;
 
   struct Node
   {
-    Node() : erased(false) {}
+    Node(Node* p=0) : parent(p), erased(false), axe(0), size(1), dead(0) {}
 
     point    plane;
     node_ptr left, right;
+    Node*    parent;
     bool     erased;
+    int      axe;   // Split axis
+    size_t   size;  // Leaves in this subtree
+    size_t   dead;  // Erased leaves in this subtree
 
-    void split(const point& middle)
+    void split(const point& middle, int a)
     {
       plane = middle;
-      left = node_ptr(new Node);
-      right = node_ptr(new Node);
+      axe = a;
+      left = node_ptr(new Node(this));
+      right = node_ptr(new Node(this));
+    }
+
+    size_t live() const { return size - dead; }
+
+    void mark_erased()
+    {
+      if (erased) return;
+      erased = true;
+      for (Node* n = this; n; n = n->parent)
+        ++n->dead;
     }
   };
   node_ptr m_Root;
 
+  // A subtree is rebuilt when one side holds more than this fraction of its leaves,
+  // or when at least half of its leaves are erased.
+  static double balance_factor() { return 0.7; }
+  static size_t min_rebuild_size() { return 8; }
+
   class Iterator : public std::iterator<std::forward_iterator_tag,point>
   {
+    friend class KDTree;
     typedef std::vector<node_ptr> stack_type;
     stack_type stack;
 
+    node_ptr leaf() const { return stack.empty() ? node_ptr() : stack.back(); }
+
     void add_branch(node_ptr root)
     {
       while (root)
@@ -76,7 +331,7 @@ class TwoDTree
     void erase()
     {
       if (!stack.empty())
-        stack.back()->erased = true;
+        stack.back()->mark_erased();
     }
 
     const point& operator* () const { return stack.back()->plane; }
@@ -106,82 +361,273 @@ class TwoDTree
   struct axe_pred : public std::binary_function<point, point, bool>
   {
     int m_Axe;
-    axe_pred(int depth) : m_Axe(depth&1) {}
+    axe_pred(int depth) : m_Axe(depth % Dims) {}
     bool operator() (const point& p1, const point& p2) const
     {
-      if (m_Axe == 0) return p1.x < p2.x;
-      return p1.y < p2.y;
+      return coords::get(p1, m_Axe) < coords::get(p2, m_Axe);
     }
   };
 
-  static value_type axe_point(const point& p, int depth)
+  static value_type axe_point(const point& p, int axe)
   {
-    if ((depth & 1) == 0) return p.x;
-    return p.y;
+    return coords::get(p, axe);
   }
 
+  // Split axis of [b,e): the depth's axis, or when the points all share that
+  // coordinate, the next axis along which they differ
   template<class II>
-  static value_type find_median(II b, II e, int depth)
+  static int split_axe(II b, II e, int depth)
+  {
+    for (int i = 0; i < Dims; ++i)
+    {
+      int axe = (depth + i) % Dims;
+      value_type v = axe_point(*b, axe);
+      if (std::any_of(b, e, [axe, v](const point& p) { return axe_point(p, axe) != v; })) return axe;
+    }
+    return depth % Dims;
+  }
+
+  static void get_coords(const point& p, value_type* c)
   {
-    unsigned n = unsigned(std::distance(b, e));
-    unsigned n2 = n / 2;
-    std::nth_element(b, b + n2, e,axe_pred(depth));
-    return axe_point(*(b + n2), depth);
+    auto f = [&p, c](int axe) { c[axe] = coords::get(p, axe); };
+    KDUnroll<Dims>::apply(f);
+  }
+
+  template<class II>
+  struct BuildJob
+  {
+    BuildJob(node_ptr n, II B, II E, int d) : node(n), b(B), e(E), depth(d) {}
+    node_ptr node;
+    II       b, e;
+    int      depth;
+  };
+
+  // Splits the top of the tree on the calling thread, and collects the subtrees
+  // of up to job_size points so they can be built independently.
+  template<class II>
+  void build_top(node_ptr& root, II b, II e, int depth, size_t job_size, std::vector<BuildJob<II>>& jobs)
+  {
+    size_t n = size_t(std::distance(b, e));
+    if (n <= job_size)
+    {
+      jobs.push_back(BuildJob<II>(root, b, e, depth));
+      return;
+    }
+    root->size = n;
+    II mid = split(root, b, e, depth);
+    build_top(root->left, b, mid, depth + 1, job_size, jobs);
+    build_top(root->right, mid, e, depth + 1, job_size, jobs);
   }
 
   template<class II>
   void build(node_ptr& root, II b, II e, int depth)
   {
-    int n = int(std::distance(b, e));
+    size_t n = size_t(std::distance(b, e));
+    root->size = n;
     if (n == 1) root->plane = *b;
     else
     {
-      value_type median = find_median(b, e, depth);
-      II mid=std::partition(b, e, [depth, median](const point& p) { return axe_point(p, depth) < median; });
-      if (mid == b) ++mid;
-      root->split(*mid);
+      II mid = split(root, b, e, depth);
       build(root->left, b, mid, depth + 1);
       build(root->right, mid, e, depth + 1);
     }
   }
 
-  int find_nn(const node_ptr& node, const point& p, Optimizer<node_ptr>& opt, int depth) const
+  // Splits root at the median position along its split axis.  nth_element leaves
+  // [b,mid) no greater and [mid,e) no smaller than the split, so points equal to it
+  // may fall on either side, which the searches allow for.  Cutting at the position
+  // rather than by value keeps both halves balanced however many points share a
+  // coordinate; otherwise such points would all go to one side, and rebuilding a
+  // subtree could never balance it.
+  template<class II>
+  II split(node_ptr& root, II b, II e, int depth)
+  {
+    int axe = split_axe(b, e, depth);
+    II mid = b + std::distance(b, e) / 2;
+    std::nth_element(b, mid, e, axe_pred(axe));
+    root->split(*mid, axe);
+    return mid;
+  }
+
+  static void collect_live(const node_ptr& node, std::vector<point>& points)
+  {
+    if (!node->left)
+    {
+      if (!node->erased) points.push_back(node->plane);
+      return;
+    }
+    if (node->left->live() > 0) collect_live(node->left, points);
+    if (node->right->live() > 0) collect_live(node->right, points);
+  }
+
+  bool needs_rebuild(const Node* node) const
+  {
+    if (!node->left || node->size < min_rebuild_size()) return false;
+    if (2 * node->dead >= node->size) return true;
+    size_t larger = std::max(node->left->size, node->right->size);
+    return larger > balance_factor() * node->size;
+  }
+
+  // Replace the subtree at node (found at the given depth) with a balanced one
+  // holding only its live points, and fix the counts of its ancestors.
+  // The subtree must contain at least one live point.
+  void rebuild(Node* node, int depth)
+  {
+    std::vector<point> points;
+    points.reserve(node->live());
+    if (!node->left) points.push_back(node->plane);
+    else
+    {
+      collect_live(node->left, points);
+      collect_live(node->right, points);
+    }
+    Node* parent = node->parent;
+    node_ptr& slot = (!parent ? m_Root : (parent->left.get() == node ? parent->left : parent->right));
+    size_t dead = node->dead;
+    node_ptr fresh(new Node(parent));
+    build(fresh, points.begin(), points.end(), depth);
+    slot = fresh;
+    for (Node* n = parent; n; n = n->parent)
+    {
+      n->size -= dead;
+      n->dead -= dead;
+    }
+  }
+
+  int find_nn(const node_ptr& node, const point& p, Optimizer<node_ptr>& opt, KDSearch& search, int depth) const
   {
     int res = 0;
+    if (search.exhausted()) return res;
+    if (node->live() == 0)
+    {
+      ++search.cost.pruned;
+      return res;
+    }
+    search.visit(depth);
     if (!node->left)
     {
       res = 1;
+      ++search.leaves;
       if (!node->erased)
-        opt.add(node, sqdist(node->plane, p));
+        opt.add(node, kd_sqdist<Dims>(node->plane, p));
       return res;
     }
-    value_type dist = axe_point(p, depth) - axe_point(node->plane, depth);
+    value_type dist = axe_point(p, node->axe) - axe_point(node->plane, node->axe);
     value_type d2 = dist*dist;
     if (dist < 0)
     {
-      res+=find_nn(node->left, p, opt, depth + 1);
-      if (d2 <= opt.get_best_score()) 
-        res += find_nn(node->right, p, opt, depth + 1);
+      res+=find_nn(node->left, p, opt, search, depth + 1);
+      if (d2 * search.scale <= opt.get_best_score()) 
+        res += find_nn(node->right, p, opt, search, depth + 1);
+      else ++search.cost.pruned;
     }
     else
     {
-      res += find_nn(node->right, p, opt, depth + 1);
-      if (d2 <= opt.get_best_score())
-        res += find_nn(node->left, p, opt, depth + 1);
+      res += find_nn(node->right, p, opt, search, depth + 1);
+      if (d2 * search.scale <= opt.get_best_score())
+        res += find_nn(node->left, p, opt, search, depth + 1);
+      else ++search.cost.pruned;
     }
     return res;
   }
 
+  // Bottom up search: the leaf start is tested first, then on the way back to the
+  // root, the sibling of every node on the path when it may hold a closer point.
+  void find_nn_from(const node_ptr& start, const point& p, Optimizer<node_ptr>& opt, KDSearch& search) const
+  {
+    int depth = 0;
+    for (const Node* n = start.get(); n->parent; n = n->parent) ++depth;
+    find_nn(start, p, opt, search, depth);
+    for (const Node* child = start.get(); child->parent; child = child->parent)
+    {
+      const Node* node = child->parent;
+      --depth;
+      bool left = (node->left.get() == child);
+      // Distance from p to the sibling's side of the split, negative when p is inside it
+      value_type gap = axe_point(p, node->axe) - axe_point(node->plane, node->axe);
+      if (left) gap = -gap;
+      if (gap <= 0 || gap * gap * search.scale <= opt.get_best_score())
+        find_nn(left ? node->right : node->left, p, opt, search, depth + 1);
+      else ++search.cost.pruned;
+    }
+  }
+
+  // Search for p into opt, starting at the leaf start when given, and from the bound
+  // hint of params when set
+  void find_nn(const point& p, Optimizer<node_ptr>& opt, const KDSearchParams& params, const node_ptr& start) const
+  {
+    double unbounded = std::numeric_limits<float>::max();
+    double bound = params.initial_bound(unbounded);
+    opt.set_best_score(bound);
+    if (!m_Root) return;
+    KDSearch search(params);
+    if (start) find_nn_from(start, p, opt, search);
+    else find_nn(m_Root, p, opt, search, 0);
+    if (bound < unbounded && opt.get_best_score() >= bound)
+    {
+      opt.set_best_score(unbounded);
+      if (start) find_nn_from(start, p, opt, search);
+      else find_nn(m_Root, p, opt, search, 0);
+    }
+  }
+
+  template<class F>
+  void visit_radius(const node_ptr& node, const point& p, value_type r2, F& f, int depth) const
+  {
+    if (node->live() == 0) return;
+    if (!node->left)
+    {
+      if (!node->erased && kd_sqdist<Dims>(node->plane, p) <= r2)
+        f(node->plane);
+      return;
+    }
+    value_type dist = axe_point(p, node->axe) - axe_point(node->plane, node->axe);
+    value_type d2 = dist*dist;
+    if (dist <= 0 || d2 <= r2) visit_radius(node->left, p, r2, f, depth + 1);
+    if (dist >= 0 || d2 <= r2) visit_radius(node->right, p, r2, f, depth + 1);
+  }
+
+  template<class INSIDE, class F>
+  void visit_box(const node_ptr& node, const value_type* lo, const value_type* hi, INSIDE& inside, F& f, int depth) const
+  {
+    if (node->live() == 0) return;
+    if (!node->left)
+    {
+      value_type c[Dims];
+      get_coords(node->plane, c);
+      if (!node->erased && inside(c))
+        f(node->plane);
+      return;
+    }
+    value_type split = axe_point(node->plane, node->axe);
+    if (lo[node->axe] <= split) visit_box(node->left, lo, hi, inside, f, depth + 1);
+    if (hi[node->axe] >= split) visit_box(node->right, lo, hi, inside, f, depth + 1);
+  }
+
 public:
   typedef Iterator iterator;
   iterator begin() { return Iterator(m_Root); }
   iterator end()   { return Iterator(node_ptr()); }
 
-  void find_knn(const point& p, int k, iterator* res, double* scores=0) const
+  void find_knn(const point& p, int k, iterator* res, double* scores=0, const KDSearchParams& params=KDSearchParams()) const
+  {
+    find_knn(p, k, res, scores, Iterator(), params);
+  }
+
+  iterator find_nn(const point& p, const KDSearchParams& params=KDSearchParams()) const
+  {
+    return find_nn(p, Iterator(), params);
+  }
+
+  // Warm started searches, for queries close to an earlier one.  The search starts
+  // at the leaf of hint, typically the previous result, and works outward from it,
+  // so it is cheap when the answer is nearby.  Results are the same as without the
+  // hint.  The hint must come from the current tree: insert and compact invalidate it.
+  void find_knn(const point& p, int k, iterator* res, double* scores, const iterator& hint, 
+                const KDSearchParams& params=KDSearchParams()) const
   {
     Optimizer<node_ptr> opt(k);
-    opt.set_best_score(std::numeric_limits<float>::max());
-    find_nn(m_Root, p, opt, 0);
+    find_nn(p, opt, params, hint.leaf());
     std::vector<node_ptr> pres(k);
     opt.get_best(&pres[0]);
     for (int i = 0; i < k; ++i)
@@ -190,58 +636,880 @@ public:
       opt.get_best_scores(scores);
   }
 
-  iterator find_nn(const point& p) const
+  iterator find_nn(const point& p, const iterator& hint, const KDSearchParams& params=KDSearchParams()) const
   {
     Optimizer<node_ptr> opt;
-    opt.set_best_score(std::numeric_limits<float>::max());
-    find_nn(m_Root, p, opt, 0);
+    find_nn(p, opt, params, hint.leaf());
     return iterator(opt.get_best());
   }
 
+  // Number of live (not erased) points
+  size_t size() const { return m_Root ? m_Root->live() : 0; }
+
   void erase(iterator it)
   {
     it.erase();
   }
 
+  // Adds a single point.  Going down the tree, it replaces an erased leaf when it
+  // reaches one, otherwise the leaf is split in two.  The highest subtree on the way
+  // that became unbalanced or is mostly erased is then rebuilt (scapegoat style),
+  // which keeps queries logarithmic under a steady stream of inserts and erases.
+  // Inserting invalidates existing iterators.
+  void insert(const point& p)
+  {
+    if (!m_Root)
+    {
+      m_Root = node_ptr(new Node);
+      m_Root->plane = p;
+      return;
+    }
+    Node* node = m_Root.get();
+    int depth = 0;
+    for (; node->left; ++depth)
+      node = (axe_point(p, node->axe) < axe_point(node->plane, node->axe) ? node->left.get() : node->right.get());
+    if (node->erased)
+    {
+      node->plane = p;
+      node->erased = false;
+      for (Node* n = node; n; n = n->parent)
+        --n->dead;
+    }
+    else
+    {
+      point q = node->plane;
+      int axe = depth % Dims;
+      for (int i = 1; i < Dims && axe_point(p, axe) == axe_point(q, axe); ++i)
+        axe = (depth + i) % Dims;
+      bool before = axe_point(p, axe) < axe_point(q, axe);
+      node->split(before ? q : p, axe);
+      node->left->plane = (before ? p : q);
+      node->right->plane = (before ? q : p);
+      for (Node* n = node; n; n = n->parent)
+        ++n->size;
+    }
+    Node* scapegoat = 0;
+    int scapegoat_depth = 0;
+    for (Node* n = node; n; n = n->parent, --depth)
+    {
+      if (needs_rebuild(n))
+      {
+        scapegoat = n;
+        scapegoat_depth = depth;
+      }
+    }
+    if (scapegoat) rebuild(scapegoat, scapegoat_depth);
+  }
+
   template<class II>
-  void build(II b, II e)
+  void insert(II b, II e)
+  {
+    for (; b != e; ++b)
+      insert(*b);
+  }
+
+  // Physically removes all erased points, rebalancing the whole tree.
+  // Invalidates existing iterators.
+  void compact()
+  {
+    if (!m_Root || m_Root->dead == 0) return;
+    if (m_Root->live() == 0) m_Root.reset();
+    else rebuild(m_Root.get(), 0);
+  }
+
+  // Range queries.  The visit_ forms call f(const point&) for every point found,
+  // the count_ forms only count them.  Neither allocates.
+
+  // Points within distance r of p
+  template<class F>
+  void visit_in_radius(const point& p, double r, F f) const
   {
+    if (m_Root) visit_radius(m_Root, p, value_type(r*r), f, 0);
+  }
+
+  // Points inside the closed box spanned by lo and hi
+  template<class F>
+  void visit_in_box(const point& lo, const point& hi, F f) const
+  {
+    value_type l[Dims], h[Dims];
+    get_coords(lo, l);
+    get_coords(hi, h);
+    auto inside = [&l, &h](const value_type* c)
+    {
+      for (int axe = 0; axe < Dims; ++axe)
+        if (c[axe] < l[axe] || c[axe] > h[axe]) return false;
+      return true;
+    };
+    if (m_Root) visit_box(m_Root, l, h, inside, f, 0);
+  }
+
+  // Points inside r, with the same half open bounds as Rect::contains
+  template<class F>
+  void visit_in_rect(const Rect& r, F f) const
+  {
+    static_assert(Dims == 2, "Rect queries require a two dimensional tree");
+    value_type l[] = { value_type(r.l), value_type(r.t) }, h[] = { value_type(r.r), value_type(r.b) };
+    auto inside = [&r](const value_type* c) { return c[0] >= r.l && c[0] < r.r && c[1] >= r.t && c[1] < r.b; };
+    if (m_Root) visit_box(m_Root, l, h, inside, f, 0);
+  }
+
+  size_t count_in_radius(const point& p, double r) const
+  {
+    size_t n = 0;
+    visit_in_radius(p, r, [&n](const point&) { ++n; });
+    return n;
+  }
+
+  size_t count_in_box(const point& lo, const point& hi) const
+  {
+    size_t n = 0;
+    visit_in_box(lo, hi, [&n](const point&) { ++n; });
+    return n;
+  }
+
+  size_t count_in_rect(const Rect& r) const
+  {
+    size_t n = 0;
+    visit_in_rect(r, [&n](const point&) { ++n; });
+    return n;
+  }
+
+  // Builds the tree over [b,e), reordering that range.  When parallel is set, subtrees
+  // are built on TaskManager workers once they are small enough; the result is the
+  // same as that of the serial build.
+  template<class II>
+  void build(II b, II e, bool parallel=false)
+  {
+    m_Root.reset();
+    if (b == e) return;
     m_Root = node_ptr(new Node);
-    build(m_Root, b, e, 0);
+    if (!parallel)
+    {
+      build(m_Root, b, e, 0);
+      return;
+    }
+    std::vector<BuildJob<II>> jobs;
+    build_top(m_Root, b, e, 0, kd_parallel_job_size(size_t(std::distance(b, e))), jobs);
+    parallel_chunks(jobs.size(), 1, [this, &jobs](size_t jb, size_t je)
+    {
+      for (size_t j = jb; j < je; ++j)
+        build(jobs[j].node, jobs[j].b, jobs[j].e, jobs[j].depth);
+    });
   }
 
 };
 
+template<class POINT>
+using TwoDTree = KDTree<POINT,2>;
+
+class MappedFile;
+
+template<class POINT, int Dims>
+class FlatKDTreeImage;
+
+// Flat, pointer-free counterpart of KDTree.
+// The tree is implicit: the subtree covering positions [b,e) splits at m=(b+e)/2,
+// with its left child covering [b,m) and its right child [m,e).  Since every split
+// position is unique, split values are kept in one array indexed by position.
+// Leaf coordinates are stored per axis in contiguous arrays, and the full points
+// (including any payload) in a separate array that is only touched when a result
+// is dereferenced.
+template<class POINT, int Dims>
+class FlatKDTree
+{
+  typedef FlatKDTree<POINT,Dims> self;
+  typedef POINT point;
+  typedef typename POINT::value_type value_type;
+  typedef KDCoords<POINT,Dims> coords;
+  typedef std::vector<point> point_vec;
+  typedef std::vector<value_type> value_vec;
+  typedef std::vector<char> flag_vec;
+
+  // Storage of a tree built in memory
+  value_vec m_CoordsData[Dims];
+  value_vec m_SplitData;
+  point_vec m_PointsData;
+  flag_vec  m_ErasedData;
+
+  // Views used by queries, pointing either at the storage above or into a mapped image
+  const value_type*           m_Coords[Dims];
+  const value_type*           m_Split;
+  const point*                m_Points;
+  char*                       m_Erased;
+  size_t                      m_Size;
+  size_t                      m_Bucket;
+  std::shared_ptr<MappedFile> m_Image;
+
+  friend class FlatKDTreeImage<POINT,Dims>;
+
+  void attach_data()
+  {
+    m_Image.reset();
+    m_Size = m_PointsData.size();
+    m_Split = m_SplitData.data();
+    for (int axe = 0; axe < Dims; ++axe) m_Coords[axe] = m_CoordsData[axe].data();
+    m_Points = m_PointsData.data();
+    m_Erased = m_ErasedData.data();
+  }
+
+  class Iterator
+  {
+    const self* m_Tree;
+    size_t      m_Index;
+
+    void skip_erased()
+    {
+      while (m_Index < m_Tree->size() && m_Tree->m_Erased[m_Index]) ++m_Index;
+    }
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef point                     value_type;
+    typedef std::ptrdiff_t            difference_type;
+    typedef const point*              pointer;
+    typedef const point&              reference;
+
+    Iterator() : m_Tree(0), m_Index(0) {}
+    Iterator(const self* tree, size_t index) : m_Tree(tree), m_Index(index) 
+    { 
+      skip_erased(); 
+    }
+
+    size_t index() const { return m_Index; }
+
+    const point& operator* () const { return m_Tree->m_Points[m_Index]; }
+    const point* operator-> () const { return &(m_Tree->m_Points[m_Index]); }
+    Iterator& operator++()
+    {
+      ++m_Index;
+      skip_erased();
+      return *this;
+    }
+
+    bool operator== (const Iterator& rhs) const { return m_Index == rhs.m_Index; }
+    bool operator!= (const Iterator& rhs) const { return !(*this == rhs); }
+  };
+
+  struct axe_pred
+  {
+    int m_Axe;
+    axe_pred(int depth) : m_Axe(depth % Dims) {}
+    bool operator() (const point& p1, const point& p2) const
+    {
+      return coords::get(p1, m_Axe) < coords::get(p2, m_Axe);
+    }
+  };
+
+  static value_type axe_point(const point& p, int depth)
+  {
+    return coords::get(p, depth % Dims);
+  }
+
+  static void get_coords(const point& p, value_type* c)
+  {
+    auto f = [&p, c](int axe) { c[axe] = coords::get(p, axe); };
+    KDUnroll<Dims>::apply(f);
+  }
+
+  bool is_leaf(size_t b, size_t e) const { return e - b <= m_Bucket; }
+
+  void fill_coords(size_t b, size_t e)
+  {
+    for (int axe = 0; axe < Dims; ++axe)
+      for (size_t i = b; i < e; ++i)
+        m_CoordsData[axe][i] = coords::get(m_PointsData[i], axe);
+  }
+
+  // Squared distances from p to every point of the bucket [b,e), written to d2.
+  // Coordinates are stored per axis, so each axis is one contiguous vector loop.
+  void bucket_sqdist(size_t b, size_t e, const point& p, value_type* d2) const
+  {
+    size_t n = e - b;
+    for (size_t i = 0; i < n; ++i) d2[i] = 0;
+    auto f = [this, b, n, &p, d2](int axe) { kd_accumulate_sqdiff(m_Coords[axe] + b, coords::get(p, axe), d2, n); };
+    KDUnroll<Dims>::apply(f);
+  }
+
+  size_t split(size_t b, size_t e, int depth)
+  {
+    size_t m = b + (e - b) / 2;
+    typename point_vec::iterator first = m_PointsData.begin();
+    std::nth_element(first + b, first + m, first + e, axe_pred(depth));
+    m_SplitData[m] = axe_point(m_PointsData[m], depth);
+    return m;
+  }
+
+  void build(size_t b, size_t e, int depth)
+  {
+    if (is_leaf(b, e)) return;
+    size_t m = split(b, e, depth);
+    build(b, m, depth + 1);
+    build(m, e, depth + 1);
+  }
+
+  struct BuildJob
+  {
+    BuildJob(size_t B, size_t E, int d) : b(B), e(E), depth(d) {}
+    size_t b, e;
+    int    depth;
+  };
+
+  // Splits the top of the tree on the calling thread, and collects the subtrees
+  // of up to job_size points so they can be built independently.
+  void build_top(size_t b, size_t e, int depth, size_t job_size, std::vector<BuildJob>& jobs)
+  {
+    if (e - b <= job_size || is_leaf(b, e))
+    {
+      jobs.push_back(BuildJob(b, e, depth));
+      return;
+    }
+    size_t m = split(b, e, depth);
+    build_top(b, m, depth + 1, job_size, jobs);
+    build_top(m, e, depth + 1, job_size, jobs);
+  }
+
+  template<class OPT>
+  void find_nn(size_t b, size_t e, const point& p, OPT& opt, KDSearch& search, int depth) const
+  {
+    if (search.exhausted()) return;
+    search.visit(depth);
+    if (is_leaf(b, e))
+    {
+      ++search.leaves;
+      value_type d2[MAX_BUCKET];
+      bucket_sqdist(b, e, p, d2);
+      for (size_t i = b; i < e; ++i)
+        if (!m_Erased[i]) opt.add(i, d2[i - b]);
+      return;
+    }
+    size_t m = b + (e - b) / 2;
+    value_type dist = axe_point(p, depth) - m_Split[m];
+    value_type d2 = dist*dist;
+    if (dist < 0)
+    {
+      find_nn(b, m, p, opt, search, depth + 1);
+      if (d2 * search.scale <= opt.get_best_score())
+        find_nn(m, e, p, opt, search, depth + 1);
+      else ++search.cost.pruned;
+    }
+    else
+    {
+      find_nn(m, e, p, opt, search, depth + 1);
+      if (d2 * search.scale <= opt.get_best_score())
+        find_nn(b, m, p, opt, search, depth + 1);
+      else ++search.cost.pruned;
+    }
+  }
+
+  template<class F>
+  void visit_radius(size_t b, size_t e, const point& p, value_type r2, F& f, int depth) const
+  {
+    if (is_leaf(b, e))
+    {
+      value_type d2[MAX_BUCKET];
+      bucket_sqdist(b, e, p, d2);
+      for (size_t i = b; i < e; ++i)
+        if (!m_Erased[i] && d2[i - b] <= r2) f(m_Points[i]);
+      return;
+    }
+    size_t m = b + (e - b) / 2;
+    value_type dist = axe_point(p, depth) - m_Split[m];
+    value_type d2 = dist*dist;
+    if (dist <= 0 || d2 <= r2) visit_radius(b, m, p, r2, f, depth + 1);
+    if (dist >= 0 || d2 <= r2) visit_radius(m, e, p, r2, f, depth + 1);
+  }
+
+  template<class INSIDE, class F>
+  void visit_box(size_t b, size_t e, const value_type* lo, const value_type* hi, INSIDE& inside, F& f, int depth) const
+  {
+    if (is_leaf(b, e))
+    {
+      for (size_t i = b; i < e; ++i)
+      {
+        value_type c[Dims];
+        auto g = [this, i, &c](int axe) { c[axe] = m_Coords[axe][i]; };
+        KDUnroll<Dims>::apply(g);
+        if (!m_Erased[i] && inside(c))
+          f(m_Points[i]);
+      }
+      return;
+    }
+    size_t m = b + (e - b) / 2;
+    if (lo[depth % Dims] <= m_Split[m]) visit_box(b, m, lo, hi, inside, f, depth + 1);
+    if (hi[depth % Dims] >= m_Split[m]) visit_box(m, e, lo, hi, inside, f, depth + 1);
+  }
+
+  // Bottom up search: the bucket holding position start is tested first, then on the
+  // way back to the root, the sibling of every range on the path when it may hold a
+  // closer point.
+  template<class OPT>
+  void find_nn_from(size_t start, const point& p, OPT& opt, KDSearch& search) const
+  {
+    // Ranges on the path from the root, at most one per bit of the size
+    size_t pb[64], pe[64];
+    size_t b = 0, e = size();
+    int depth = 0;
+    while (!is_leaf(b, e))
+    {
+      pb[depth] = b;
+      pe[depth++] = e;
+      size_t m = b + (e - b) / 2;
+      if (start < m) e = m;
+      else b = m;
+    }
+    find_nn(b, e, p, opt, search, depth);
+    while (depth-- > 0)
+    {
+      b = pb[depth];
+      e = pe[depth];
+      size_t m = b + (e - b) / 2;
+      bool left = (start < m);
+      // Distance from p to the sibling's side of the split, negative when p is inside it
+      value_type gap = axe_point(p, depth) - m_Split[m];
+      if (left) gap = -gap;
+      if (gap <= 0 || gap * gap * search.scale <= opt.get_best_score())
+      {
+        if (left) find_nn(m, e, p, opt, search, depth + 1);
+        else find_nn(b, m, p, opt, search, depth + 1);
+      }
+      else ++search.cost.pruned;
+    }
+  }
+
+  // Search for p into opt, starting at the bucket of position start when it is in the
+  // tree, and from the bound hint of params when set
+  template<class OPT>
+  void find_nn(const point& p, OPT& opt, const KDSearchParams& params, size_t start) const
+  {
+    double bound = params.initial_bound(initial_bound());
+    opt.set_best_score(bound);
+    if (size() == 0) return;
+    KDSearch search(params);
+    if (start < size()) find_nn_from(start, p, opt, search);
+    else find_nn(0, size(), p, opt, search, 0);
+    if (bound < initial_bound() && opt.get_best_score() >= bound)
+    {
+      opt.set_best_score(initial_bound());
+      if (start < size()) find_nn_from(start, p, opt, search);
+      else find_nn(0, size(), p, opt, search, 0);
+    }
+  }
+
+  static double initial_bound() { return std::numeric_limits<float>::max(); }
+
+  template<class OPT>
+  void find_knn(const point& p, int k, Iterator* res, double* scores, const Iterator& hint, 
+                const KDSearchParams& params, OPT& opt) const
+  {
+    find_nn(p, opt, params, hint.index());
+    std::vector<size_t> pres(k);
+    std::vector<double> pscores(k);
+    opt.get_best(&pres[0]);
+    opt.get_best_scores(&pscores[0]);
+    for (int i = 0; i < k; ++i)
+      res[i] = (pscores[i] < initial_bound() ? Iterator(this, pres[i]) : end());
+    if (scores)
+      std::copy(pscores.begin(), pscores.end(), scores);
+  }
+
+  // Queries [b,e) of the batched find_knn, reusing opt and one scratch buffer
+  template<class OPT>
+  void find_knn(const point* queries, size_t b, size_t e, int k, size_t* idx, double* scores, 
+                const KDSearchParams& params, const size_t* hints, OPT& opt) const
+  {
+    std::vector<double> scratch(k);
+    for (size_t q = b; q < e; ++q)
+    {
+      size_t* qidx = idx + q*k;
+      double* qscores = (scores ? scores + q*k : &scratch[0]);
+      find_nn(queries[q], opt, params, hints ? hints[q*k] : size());
+      opt.get_best(qidx);
+      opt.get_best_scores(qscores);
+      for (int i = 0; i < k; ++i)
+        if (qscores[i] >= initial_bound()) qidx[i] = size();
+    }
+  }
+
+public:
+  // Largest number of points a leaf bucket may hold
+  static const size_t MAX_BUCKET = 64;
+
+  // Leaves hold up to bucket_size points, which are scanned together.
+  // Larger buckets make the tree shallower, at the cost of more distance computations.
+  FlatKDTree(size_t bucket_size=8)
+  : m_Bucket(bucket_size < 1 ? 1 : (bucket_size > MAX_BUCKET ? MAX_BUCKET : bucket_size))
+  {
+    attach_data();
+  }
+
+  // Copies of a loaded tree share its read-only mapped image, but own their erase flags
+  FlatKDTree(const self& rhs)
+  {
+    *this = rhs;
+  }
+
+  self& operator= (const self& rhs)
+  {
+    if (this == &rhs) return *this;
+    for (int axe = 0; axe < Dims; ++axe) m_CoordsData[axe] = rhs.m_CoordsData[axe];
+    m_SplitData = rhs.m_SplitData;
+    m_PointsData = rhs.m_PointsData;
+    m_ErasedData = rhs.m_ErasedData;
+    m_Bucket = rhs.m_Bucket;
+    attach_data();
+    if (rhs.m_Image)
+    {
+      m_Image = rhs.m_Image;
+      m_Size = rhs.m_Size;
+      m_Split = rhs.m_Split;
+      for (int axe = 0; axe < Dims; ++axe) m_Coords[axe] = rhs.m_Coords[axe];
+      m_Points = rhs.m_Points;
+      m_ErasedData.assign(rhs.m_Erased, rhs.m_Erased + m_Size);
+      m_Erased = m_ErasedData.data();
+    }
+    return *this;
+  }
+
+  size_t bucket_size() const { return m_Bucket; }
+
+  typedef Iterator iterator;
+  iterator begin() const { return Iterator(this, 0); }
+  iterator end()   const { return Iterator(this, size()); }
+
+  size_t size() const { return m_Size; }
+
+  const point& get(size_t index) const { return m_Points[index]; }
+  const point& operator[] (size_t index) const { return get(index); }
+
+  // Batched form of find_knn.  For query q, the indices (see get) of its k nearest points
+  // and their squared distances are written best first to idx[q*k .. q*k+k) and
+  // scores[q*k .. q*k+k).  Missing neighbours are given the index size().
+  // Queries are spread over the TaskManager pool, and each chunk reuses a single set of
+  // scratch buffers, so the query loop itself does not allocate.
+  // For tracking, hints may hold the idx of an earlier call over nearby queries (it may
+  // be idx itself): each search then starts at the bucket of the previous nearest point.
+  void find_knn(const point* queries, size_t n, int k, size_t* idx, double* scores=0, 
+                const KDSearchParams& params=KDSearchParams(), const size_t* hints=0) const
+  {
+    std::mutex mutex;
+    parallel_chunks(n, 64, [this, queries, k, idx, scores, &params, hints, &mutex](size_t b, size_t e)
+    {
+      KDSearchStats stats;
+      KDSearchParams chunk_params = params;
+      if (params.stats) chunk_params.stats = &stats;
+      if (k > KD_HEAP_K)
+      {
+        HeapOptimizer<size_t> opt(k);
+        find_knn(queries, b, e, k, idx, scores, chunk_params, hints, opt);
+      }
+      else
+      {
+        Optimizer<size_t> opt(k);
+        find_knn(queries, b, e, k, idx, scores, chunk_params, hints, opt);
+      }
+      if (params.stats)
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        params.stats->add(stats);
+      }
+    });
+  }
+
+  // Self join: fills graph with the k nearest other points of every point in the tree.
+  // Nodes are tree positions (see get); erased points get no neighbours and are
+  // never reported.  Points are queried in tree order, so consecutive queries touch
+  // the same branches and buckets, and the rows are spread over the TaskManager pool.
+  // Each search starts from the bucket of its own point.  With k <= 0 every row is empty.
+  void knn_graph(int k, KNNGraph& graph, const KDSearchParams& params=KDSearchParams()) const
+  {
+    size_t n = size();
+    graph.offsets.assign(n + 1, 0);
+    if (k <= 0)
+    {
+      graph.neighbors.clear();
+      graph.distances.clear();
+      return;
+    }
+    graph.neighbors.resize(n * k);
+    graph.distances.resize(n * k);
+    std::mutex mutex;
+    parallel_chunks(n, 256, [this, k, n, &graph, &params, &mutex](size_t b, size_t e)
+    {
+      Optimizer<size_t> opt(k + 1);
+      std::vector<size_t> idx(k + 1);
+      std::vector<double> scores(k + 1);
+      KDSearchStats stats;
+      KDSearchParams chunk_params = params;
+      if (params.stats) chunk_params.stats = &stats;
+      for (size_t i = b; i < e; ++i)
+      {
+        if (m_Erased[i]) continue;
+        find_nn(m_Points[i], opt, chunk_params, i);
+        opt.get_best(&idx[0]);
+        opt.get_best_scores(&scores[0]);
+        // Rows are written at a stride of k and compacted below
+        size_t* row = &graph.neighbors[i*k];
+        double* row_distances = &graph.distances[i*k];
+        size_t count = 0;
+        for (int j = 0; j <= k && count < size_t(k) && scores[j] < initial_bound(); ++j)
+        {
+          if (idx[j] == i) continue;
+          row[count] = idx[j];
+          row_distances[count] = scores[j];
+          ++count;
+        }
+        graph.offsets[i + 1] = count;
+      }
+      if (params.stats)
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        params.stats->add(stats);
+      }
+    });
+    for (size_t i = 0; i < n; ++i)
+    {
+      size_t count = graph.offsets[i + 1], dst = graph.offsets[i];
+      std::copy(&graph.neighbors[i*k], &graph.neighbors[i*k] + count, &graph.neighbors[dst]);
+      std::copy(&graph.distances[i*k], &graph.distances[i*k] + count, &graph.distances[dst]);
+      graph.offsets[i + 1] = dst + count;
+    }
+    graph.neighbors.resize(graph.offsets[n]);
+    graph.distances.resize(graph.offsets[n]);
+  }
+
+  void find_knn(const point& p, int k, iterator* res, double* scores=0, const KDSearchParams& params=KDSearchParams()) const
+  {
+    find_knn(p, k, res, scores, end(), params);
+  }
+
+  iterator find_nn(const point& p, const KDSearchParams& params=KDSearchParams()) const
+  {
+    return find_nn(p, end(), params);
+  }
+
+  // Warm started searches, for queries close to an earlier one.  The search starts
+  // at the bucket of hint, typically the previous result, and works outward from it,
+  // so it is cheap when the answer is nearby.  Results are the same as without the hint.
+  void find_knn(const point& p, int k, iterator* res, double* scores, const iterator& hint, 
+                const KDSearchParams& params=KDSearchParams()) const
+  {
+    if (k > KD_HEAP_K)
+    {
+      HeapOptimizer<size_t> opt(k);
+      find_knn(p, k, res, scores, hint, params, opt);
+    }
+    else
+    {
+      Optimizer<size_t> opt(k);
+      find_knn(p, k, res, scores, hint, params, opt);
+    }
+  }
+
+  iterator find_nn(const point& p, const iterator& hint, const KDSearchParams& params=KDSearchParams()) const
+  {
+    FixedOptimizer<size_t,1> opt;
+    find_nn(p, opt, params, hint.index());
+    if (opt.get_best_score() < initial_bound()) return Iterator(this, opt.get_best());
+    return end();
+  }
+
+  void erase(iterator it)
+  {
+    if (it.index() < size())
+      m_Erased[it.index()] = 1;
+  }
+
+  // Range queries.  The visit_ forms call f(const point&) for every point found,
+  // the count_ forms only count them.  Neither allocates.
+
+  // Points within distance r of p
+  template<class F>
+  void visit_in_radius(const point& p, double r, F f) const
+  {
+    if (size() > 0) visit_radius(0, size(), p, value_type(r*r), f, 0);
+  }
+
+  // Points inside the closed box spanned by lo and hi
+  template<class F>
+  void visit_in_box(const point& lo, const point& hi, F f) const
+  {
+    value_type l[Dims], h[Dims];
+    get_coords(lo, l);
+    get_coords(hi, h);
+    auto inside = [&l, &h](const value_type* c)
+    {
+      for (int axe = 0; axe < Dims; ++axe)
+        if (c[axe] < l[axe] || c[axe] > h[axe]) return false;
+      return true;
+    };
+    if (size() > 0) visit_box(0, size(), l, h, inside, f, 0);
+  }
+
+  // Points inside r, with the same half open bounds as Rect::contains
+  template<class F>
+  void visit_in_rect(const Rect& r, F f) const
+  {
+    static_assert(Dims == 2, "Rect queries require a two dimensional tree");
+    value_type l[] = { value_type(r.l), value_type(r.t) }, h[] = { value_type(r.r), value_type(r.b) };
+    auto inside = [&r](const value_type* c) { return c[0] >= r.l && c[0] < r.r && c[1] >= r.t && c[1] < r.b; };
+    if (size() > 0) visit_box(0, size(), l, h, inside, f, 0);
+  }
+
+  size_t count_in_radius(const point& p, double r) const
+  {
+    size_t n = 0;
+    visit_in_radius(p, r, [&n](const point&) { ++n; });
+    return n;
+  }
+
+  size_t count_in_box(const point& lo, const point& hi) const
+  {
+    size_t n = 0;
+    visit_in_box(lo, hi, [&n](const point&) { ++n; });
+    return n;
+  }
+
+  size_t count_in_rect(const Rect& r) const
+  {
+    size_t n = 0;
+    visit_in_rect(r, [&n](const point&) { ++n; });
+    return n;
+  }
+
+  // Builds the tree over a copy of [b,e).  When parallel is set, subtrees are built
+  // on TaskManager workers once they are small enough; the result is the same as
+  // that of the serial build.
+  template<class II>
+  void build(II b, II e, bool parallel=false)
+  {
+    m_PointsData.assign(b, e);
+    size_t n = m_PointsData.size();
+    m_SplitData.assign(n, value_type());
+    m_ErasedData.assign(n, 0);
+    for (int axe = 0; axe < Dims; ++axe)
+      m_CoordsData[axe].resize(n);
+    if (!parallel)
+    {
+      build(0, n, 0);
+      fill_coords(0, n);
+    }
+    else
+    {
+      std::vector<BuildJob> jobs;
+      build_top(0, n, 0, kd_parallel_job_size(n), jobs);
+      parallel_chunks(jobs.size(), 1, [this, &jobs](size_t jb, size_t je)
+      {
+        for (size_t j = jb; j < je; ++j)
+        {
+          build(jobs[j].b, jobs[j].e, jobs[j].depth);
+          fill_coords(jobs[j].b, jobs[j].e);
+        }
+      });
+    }
+    attach_data();
+  }
+
+  // Tree images, implemented by FlatKDTreeImage in cxx/kdtree_image.h, which callers
+  // of these must include.
+
+  // Writes the tree, including erase flags, as a binary image that load() can map
+  void save(const xstring& filename) const
+  {
+    FlatKDTreeImage<POINT,Dims>::save(*this, filename);
+  }
+
+  // Maps an image written by save() and queries it in place, without deserializing
+  void load(const xstring& filename)
+  {
+    FlatKDTreeImage<POINT,Dims>::load(*this, filename);
+  }
+
+  // External memory build of an image over points_file, a raw array of points
+  static void build_image(const xstring& points_file, const xstring& image_file, 
+                          size_t memory_points=(1 << 22), size_t bucket_size=8)
+  {
+    FlatKDTreeImage<POINT,Dims>::build(points_file, image_file, memory_points, bucket_size);
+  }
+};
 
 template<class POINT>
+using FlatTwoDTree = FlatKDTree<POINT,2>;
+
+// Exhaustive search, kept as ground truth and as the fast path for small point sets.
+// Coordinates are stored per axis and scanned a block at a time with the vector
+// distance kernel.  Large sets are split across TaskManager workers, each keeping
+// its own top k, which are merged at the end.
+template<class POINT, int Dims=2>
 class BruteKDTree
 {
   typedef POINT point;
+  typedef typename POINT::value_type value_type;
+  typedef KDCoords<POINT,Dims> coords;
   typedef std::vector<point> point_seq;
+  typedef std::vector<value_type> value_vec;
+
   point_seq m_Points;
+  value_vec m_Coords[Dims];
+
+  enum { BLOCK = 256, PARALLEL_CHUNK = 1 << 16 };
+
+  void scan(size_t b, size_t e, const point& p, Optimizer<size_t>& opt) const
+  {
+    value_type d2[BLOCK];
+    for (; b < e; b += BLOCK)
+    {
+      size_t n = std::min<size_t>(BLOCK, e - b);
+      std::fill(d2, d2 + n, value_type(0));
+      auto f = [this, b, n, &p, &d2](int axe) { kd_accumulate_sqdiff(&m_Coords[axe][b], coords::get(p, axe), d2, n); };
+      KDUnroll<Dims>::apply(f);
+      for (size_t i = 0; i < n; ++i)
+        if (d2[i] < opt.get_best_score()) opt.add(b + i, d2[i]);
+    }
+  }
+
+  void search(const point& p, Optimizer<size_t>& opt) const
+  {
+    opt.set_best_score(std::numeric_limits<double>::max());
+    size_t n = m_Points.size();
+    if (n < 2 * PARALLEL_CHUNK)
+    {
+      scan(0, n, p, opt);
+      return;
+    }
+    parallel_optimize(n, PARALLEL_CHUNK, opt, [this, &p](size_t b, size_t e, Optimizer<size_t>& local)
+    {
+      scan(b, e, p, local);
+    });
+  }
 public:
   template<class II>
   void build(II b, II e)
   {
     m_Points.assign(b, e);
+    size_t n = m_Points.size();
+    for (int axe = 0; axe < Dims; ++axe)
+    {
+      m_Coords[axe].resize(n);
+      for (size_t i = 0; i < n; ++i)
+        m_Coords[axe][i] = coords::get(m_Points[i], axe);
+    }
   }
 
   const point& find_nn(const point& p) const
   {
-    Optimizer<int> opt;
-    int n = m_Points.size();
-    for (int i = 0; i < n;++i) opt.add(i, sqdist(m_Points[i], p));
+    Optimizer<size_t> opt;
+    search(p, opt);
     return m_Points[opt.get_best()];
   }
 
-  void find_knn(const point& p, int k, point* res) const
+  void find_knn(const point& p, int k, point* res, double* scores=0) const
   {
-    Optimizer<int> opt(k);
-    int n = m_Points.size();
-    for (int i = 0; i < n; ++i) opt.add(i, sqdist(m_Points[i], p));
-    std::vector<int> residx(k);
+    Optimizer<size_t> opt(k);
+    search(p, opt);
+    std::vector<size_t> residx(k);
     opt.get_best(&residx[0]);
     for (int i = 0; i < k; ++i) res[i] = m_Points[residx[i]];
+    if (scores)
+      opt.get_best_scores(scores);
   }
 };
 
@@ -1,12 +1,20 @@
 #pragma once
 
 #include <vector>
+#include <iterator>
 #include <memory>
+#include <algorithm>
+#include <utility>
+#include <type_traits>
+#include <cmath>
+#include <atomic>
 
 namespace cxx {
 
 typedef std::vector<int> int_vec;
 
+// Shared member lists, the former grouping of EquivalenceClassifier.  The classifier
+// now groups through UnionFind below; these are kept for existing users.
 class Leader;
 typedef std::shared_ptr<Leader> leader_ptr;
 
@@ -46,74 +54,269 @@ public:
   leader_ptr get_leader() const { return m_Leader; }
 };
 
+// Disjoint sets over the integers [0,size()), kept in flat arrays.
+// Unions link by rank and finds halve the paths they walk, so any sequence of
+// operations runs in nearly linear time.
+class UnionFind
+{
+  // The top bit of a rank marks roots already labelled by labels().  A root is marked
+  // when its bit equals m_Mark, which labels() flips once every root is marked, so
+  // the marks never need clearing.
+  enum { MARK = 0x80, RANK = 0x7F };
+
+  int_vec                    m_Parent;
+  std::vector<unsigned char> m_Rank;
+  int                        m_Sets;
+  unsigned char              m_Mark;
+
+  int rank(int i) const { return m_Rank[i] & RANK; }
+  bool marked(int i) const { return (m_Rank[i] & MARK) == m_Mark; }
+  void mark(int i) { m_Rank[i] = (unsigned char)((m_Rank[i] & RANK) | m_Mark); }
+public:
+  UnionFind(int n=0) : m_Sets(0), m_Mark(MARK) { resize(n); }
+
+  int size() const { return int(m_Parent.size()); }
+
+  // Number of disjoint sets
+  int sets() const { return m_Sets; }
+
+  // Grows to n elements, each new one in a set of its own
+  void resize(int n)
+  {
+    for (int i = size(); i < n; ++i)
+    {
+      m_Parent.push_back(i);
+      m_Rank.push_back((unsigned char)(m_Mark ^ MARK));
+      ++m_Sets;
+    }
+  }
+
+  // Adds an element in a set of its own and returns it
+  int add()
+  {
+    resize(size() + 1);
+    return size() - 1;
+  }
+
+  // Representative of the set holding i
+  int find(int i)
+  {
+    while (m_Parent[i] != i)
+    {
+      m_Parent[i] = m_Parent[m_Parent[i]];
+      i = m_Parent[i];
+    }
+    return i;
+  }
+
+  // Merges the sets of i and j, returning false if they were already one
+  bool unite(int i, int j)
+  {
+    i = find(i);
+    j = find(j);
+    if (i == j) return false;
+    if (rank(i) < rank(j)) std::swap(i, j);
+    m_Parent[j] = i;
+    if (rank(i) == rank(j)) ++m_Rank[i];
+    --m_Sets;
+    return true;
+  }
+
+  // Writes to labels[i] the set of element i, numbering sets 0..sets()-1 by their
+  // first element, and returns the number of sets.  When sizes is given, it receives
+  // the size of every set.  One pass over the elements, without allocating.
+  int labels(int* labels, int* sizes=0)
+  {
+    if (sizes) std::fill(sizes, sizes + sets(), 0);
+    int next = 0;
+    for (int i = 0; i < size(); ++i)
+    {
+      int r = find(i);
+      // The label of an unmarked root is set here, even ahead of i, and read back
+      // by the later elements of its set
+      if (!marked(r))
+      {
+        mark(r);
+        labels[r] = next++;
+      }
+      labels[i] = labels[r];
+      if (sizes) ++sizes[labels[i]];
+    }
+    m_Mark ^= MARK;
+    return next;
+  }
+};
+
+// Disjoint sets over [0,size()) that any number of threads may unite concurrently,
+// such as TaskManager workers reporting equivalences.  Roots are linked with an
+// atomic compare and swap, always under the smaller index, so the root of a set
+// is its smallest element and no locks are needed.  Finds halve their paths with
+// best effort compare and swaps.
+class ConcurrentUnionFind
+{
+  std::vector<std::atomic<int>> m_Parent;
+  std::atomic<int>              m_Sets;
+
+  ConcurrentUnionFind(const ConcurrentUnionFind&);
+  ConcurrentUnionFind& operator= (const ConcurrentUnionFind&);
+public:
+  ConcurrentUnionFind(int n) 
+  : m_Parent(n)
+  , m_Sets(n)
+  {
+    for (int i = 0; i < n; ++i) m_Parent[i].store(i, std::memory_order_relaxed);
+  }
+
+  int size() const { return int(m_Parent.size()); }
+
+  // Number of disjoint sets
+  int sets() const { return m_Sets.load(); }
+
+  // Smallest element of the set holding i
+  int find(int i)
+  {
+    for (;;)
+    {
+      int parent = m_Parent[i].load();
+      if (parent == i) return i;
+      int grand = m_Parent[parent].load();
+      if (grand != parent) m_Parent[i].compare_exchange_weak(parent, grand);
+      i = grand;
+    }
+  }
+
+  // Merges the sets of i and j, returning false if they were already one
+  bool unite(int i, int j)
+  {
+    for (;;)
+    {
+      i = find(i);
+      j = find(j);
+      if (i == j) return false;
+      if (i < j) std::swap(i, j);
+      // Link the larger root under the smaller one, unless another thread linked it first
+      int expected = i;
+      if (m_Parent[i].compare_exchange_strong(expected, j))
+      {
+        --m_Sets;
+        return true;
+      }
+    }
+  }
+
+  bool same(int i, int j) { return find(i) == find(j); }
+
+  // Final pass, once no thread unites anymore: writes to labels[i] the group of item i,
+  // numbering groups 0..sets()-1 by their first item, and returns the number of groups.
+  int labels(int* labels)
+  {
+    int next = 0;
+    for (int i = 0; i < size(); ++i)
+    {
+      int r = find(i);
+      labels[i] = (r == i ? next++ : labels[r]);
+    }
+    return next;
+  }
+};
+
+// Groups items by the equivalences added between them.  Items are kept in a
+// UnionFind, and the member lists of the groups are only produced when iterated,
+// with one counting sort pass over the items.  Groups come in the order of their
+// first item, and list their members in increasing order.
 template<class T>
 class EquivalenceClassifier
 {
   typedef EquivalenceClassifier<T> self;
-  typedef EquivalenceItem<T> item_type;
-  typedef std::vector<item_type> items_vec;
+  typedef std::vector<T> data_vec;
 
-  items_vec m_Items;
+  data_vec  m_Data;
+  UnionFind m_Sets;
+
+  // Groups, valid when m_GroupsValid is set: m_Group holds the group of every item,
+  // and the members of group g are m_Members[m_Offsets[g] .. m_Offsets[g+1])
+  int_vec   m_Group;
+  int_vec   m_Offsets;
+  int_vec   m_Members;
+  bool      m_GroupsValid;
+
+  template<class PRED>
+  void test_equivalence(int i, int j, PRED& p)
+  {
+    if (!equivalent(i, j) && p(get(i), get(j)))
+      add_equivalence(i, j);
+  }
 
-  /*
-  int get_leader(int i)
+  void build_groups()
   {
-    int leader=m_Items[i].get_leader();
-    if (leader<0) return i;
-    leader=get_leader(leader);
-    m_Items[i].set_leader(leader);
-    return leader;
+    if (m_GroupsValid) return;
+    int n = size(), groups = m_Sets.sets();
+    m_Group.resize(n);
+    m_Members.resize(n);
+    m_Offsets.assign(groups + 1, 0);
+    m_Sets.labels(m_Group.data(), groups > 0 ? &m_Offsets[1] : 0);
+    for (int g = 0; g < groups; ++g)
+      m_Offsets[g + 1] += m_Offsets[g];
+    // Scatter using the start of each group as its cursor, then shift the starts back
+    for (int i = 0; i < n; ++i)
+      m_Members[m_Offsets[m_Group[i]]++] = i;
+    for (int g = groups; g > 0; --g)
+      m_Offsets[g] = m_Offsets[g - 1];
+    m_Offsets[0] = 0;
+    m_GroupsValid = true;
   }
-  */
 
-  class GroupIterator : public std::iterator<std::forward_iterator_tag,int_vec>
+  class GroupIterator
   {
-    typedef typename items_vec::const_iterator base_iterator;
-    base_iterator m_Iter,m_End;
-    int           m_Index;
-    
-    bool is_valid() const
+    const self* m_Owner;
+    int         m_Group;
+    int_vec     m_Current;
+
+    void load()
     {
-      leader_ptr l=m_Iter->get_leader();
-      if (!l) return false;
-      return (l->get_members().front() == m_Index);
+      if (m_Group < int(m_Owner->m_Offsets.size()) - 1)
+        m_Current.assign(m_Owner->m_Members.begin() + m_Owner->m_Offsets[m_Group], 
+                         m_Owner->m_Members.begin() + m_Owner->m_Offsets[m_Group + 1]);
     }
   public:
-    GroupIterator(base_iterator begin, base_iterator end) 
-      : m_Iter(begin), m_End(end), m_Index(0)
+    typedef std::forward_iterator_tag iterator_category;
+    typedef int_vec                   value_type;
+    typedef std::ptrdiff_t            difference_type;
+    typedef const int_vec*            pointer;
+    typedef const int_vec&            reference;
+
+    GroupIterator(const self* owner, int group) 
+      : m_Owner(owner), m_Group(group)
     {
-      if (m_Iter!=m_End)
-      {
-        if (!is_valid()) ++(*this);
-      }
+      load();
     }
-    const int_vec& operator*  () const { return m_Iter->get_leader()->get_members(); }
-    const int_vec* operator-> () const { return &(m_Iter->get_leader()->get_members()); }
+    const int_vec& operator*  () const { return m_Current; }
+    const int_vec* operator-> () const { return &m_Current; }
     GroupIterator& operator++ () 
     {
-      while (++m_Iter!=m_End)
-      {
-        ++m_Index;
-        if (is_valid()) break;
-      }
+      ++m_Group;
+      load();
       return *this;
     }
     GroupIterator operator++ (int) { GroupIterator it=*this; ++(*this); return it; }
-    bool operator== (const GroupIterator& rhs) const { return m_Iter==rhs.m_Iter; }
+    bool operator== (const GroupIterator& rhs) const { return m_Group==rhs.m_Group; }
     bool operator!= (const GroupIterator& rhs) const { return !(*this==rhs); }
   };
 public:
-  const T& get(int i) const { return m_Items[i].get_data(); }
+  EquivalenceClassifier() : m_GroupsValid(false) {}
+
+  const T& get(int i) const { return m_Data[i]; }
   const T& operator[] (int i) const { return get(i); }
-  int  size() const { return int(m_Items.size()); }
+  int  size() const { return int(m_Data.size()); }
+
+  // Number of groups, singletons included
+  int  groups() const { return m_Sets.sets(); }
+
   int add_item(const T& item) 
   { 
-    int i= int(m_Items.size());
-    m_Items.push_back(item_type(item)); 
-    leader_ptr li(new Leader);
-    m_Items.back().set_leader(li);
-    li->add(i);
-    return i;
+    m_Data.push_back(item);
+    m_GroupsValid = false;
+    return m_Sets.add();
   }
 
   template<class II>
@@ -136,53 +339,131 @@ public:
     }
   }
 
-  void add_equivalence(int i, int j)
+  // Sub quadratic forms of add_equivalences, for large item sets.  Each one
+  // generates candidate pairs only, and calls p(get(i),get(j)), with i < j, on
+  // those that are not equivalent yet.
+
+  // Candidates are the items with equal key(item), such as a hash.  The key type
+  // needs operator< and operator==.
+  template<class KEY, class PRED>
+  void add_equivalences_by_key(KEY key, PRED p)
   {
-    if (i<0 || i>=size() || j<0 || j>=size() || i==j) return;
-    leader_ptr li=m_Items[i].get_leader();
-    leader_ptr lj=m_Items[j].get_leader();
-    if (!li || !lj)
+    typedef typename std::decay<decltype(key(std::declval<const T&>()))>::type key_type;
+    typedef std::pair<key_type,int> keyed;
+    std::vector<keyed> keys;
+    keys.reserve(size());
+    for (int i = 0; i < size(); ++i) keys.push_back(keyed(key(get(i)), i));
+    std::sort(keys.begin(), keys.end());
+    for (size_t b = 0, e = 0; b < keys.size(); b = e)
     {
-      if (!li && !lj)
-      {
-        li=leader_ptr(new Leader);
-        m_Items[i].set_leader(li);
-        li->add(i);
-      }
-      if (li) 
-      {
-        li->add(j);
-        m_Items[j].set_leader(li);
-      }
-      else
-      {
-        lj->add(i);
-        m_Items[i].set_leader(lj);
-      }
+      for (e = b + 1; e < keys.size() && keys[e].first == keys[b].first; ++e);
+      for (size_t i = b; i < e; ++i)
+        for (size_t j = i + 1; j < e; ++j)
+          test_equivalence(keys[i].second, keys[j].second, p);
+    }
+  }
+
+  // Candidates are the items whose key(item), a number, differs by at most window
+  template<class KEY, class PRED>
+  void add_equivalences_in_window(KEY key, double window, PRED p)
+  {
+    typedef std::pair<double,int> keyed;
+    std::vector<keyed> keys;
+    keys.reserve(size());
+    for (int i = 0; i < size(); ++i) keys.push_back(keyed(double(key(get(i))), i));
+    std::sort(keys.begin(), keys.end());
+    for (size_t i = 0; i < keys.size(); ++i)
+      for (size_t j = i + 1; j < keys.size() && keys[j].first - keys[i].first <= window; ++j)
+        test_equivalence(std::min(keys[i].second, keys[j].second), std::max(keys[i].second, keys[j].second), p);
+  }
+
+  // Candidates are the items within distance radius of each other, where pos(item)
+  // returns a point with x and y members.  Items are bucketed in a grid of radius
+  // sized cells, so only neighbouring cells are compared.
+  template<class POS, class PRED>
+  void add_equivalences_in_radius(POS pos, double radius, PRED p)
+  {
+    typedef std::pair<long long,long long> cell_type;
+    typedef std::pair<cell_type,int> celled;
+    if (radius <= 0)
+    {
+      // Only equal positions are in range
+      add_equivalences_by_key([&pos](const T& t) { auto c = pos(t); return std::make_pair(double(c.x), double(c.y)); }, p);
+      return;
+    }
+    std::vector<celled> cells;
+    std::vector<double> xs(size()), ys(size());
+    cells.reserve(size());
+    for (int i = 0; i < size(); ++i)
+    {
+      auto c = pos(get(i));
+      xs[i] = double(c.x);
+      ys[i] = double(c.y);
+      cells.push_back(celled(cell_type((long long)std::floor(xs[i] / radius), (long long)std::floor(ys[i] / radius)), i));
     }
-    else
+    std::sort(cells.begin(), cells.end());
+    double r2 = radius * radius;
+    auto test = [this, &xs, &ys, r2, &p](int i, int j)
     {
-      // Both i and j have leaders
-      if (li!=lj)
+      double dx = xs[i] - xs[j], dy = ys[i] - ys[j];
+      if (dx*dx + dy*dy <= r2) test_equivalence(std::min(i, j), std::max(i, j), p);
+    };
+    // Each pair of neighbouring cells is visited once: the cell itself, then the
+    // cell above it and the three to its right
+    const int neighbours[4][2] = { { 0, 1 }, { 1, -1 }, { 1, 0 }, { 1, 1 } };
+    for (size_t b = 0, e = 0; b < cells.size(); b = e)
+    {
+      const cell_type& cell = cells[b].first;
+      for (e = b + 1; e < cells.size() && cells[e].first == cell; ++e);
+      for (size_t i = b; i < e; ++i)
+        for (size_t j = i + 1; j < e; ++j)
+          test(cells[i].second, cells[j].second);
+      for (int n = 0; n < 4; ++n)
       {
-        if (li->size() < lj->size())
-        {
-          std::swap(i,j);
-          std::swap(li,lj);
-        }
-        li->unite(lj);
-        const int_vec& v=lj->get_members();
-        for(int_vec::const_iterator b=v.begin();b!=v.end();++b)
-          m_Items[*b].set_leader(li);
+        cell_type other(cell.first + neighbours[n][0], cell.second + neighbours[n][1]);
+        auto nb = std::lower_bound(cells.begin(), cells.end(), celled(other, -1));
+        for (auto it = nb; it != cells.end() && it->first == other; ++it)
+          for (size_t i = b; i < e; ++i)
+            test(cells[i].second, it->second);
       }
     }
   }
 
+  // Adds the equivalences collected concurrently in sets, whose elements are items
+  void add_equivalences(ConcurrentUnionFind& sets)
+  {
+    int n = std::min(size(), sets.size());
+    for (int i = 0; i < n; ++i)
+    {
+      int r = sets.find(i);
+      if (r != i) add_equivalence(i, r);
+    }
+  }
+
+  void add_equivalence(int i, int j)
+  {
+    if (i<0 || i>=size() || j<0 || j>=size() || i==j) return;
+    if (m_Sets.unite(i, j)) m_GroupsValid = false;
+  }
+
+  // Writes to labels[i] the group of item i, numbering groups 0..groups()-1 in the
+  // order of group_iterator, and returns the size of every group
+  int_vec labels(int* labels)
+  {
+    int_vec sizes(groups());
+    m_Sets.labels(labels, sizes.data());
+    return sizes;
+  }
+
+  // Whether i and j are in the same group
+  bool equivalent(int i, int j) { return m_Sets.find(i) == m_Sets.find(j); }
+
+  // Group iterators yield the members of each group, and are invalidated by adding
+  // items or equivalences
   typedef GroupIterator group_iterator;
-  group_iterator begin() { return group_iterator(m_Items.begin(),m_Items.end()); }
-  group_iterator end()   { return group_iterator(m_Items.end(),m_Items.end()); }
+  group_iterator begin() { build_groups(); return group_iterator(this, 0); }
+  group_iterator end()   { build_groups(); return group_iterator(this, groups()); }
 
 };
 
 } // namespace cxx
-
@@ -0,0 +1,356 @@
+#pragma once
+
+#include <cxx/2dtree.h>
+#include <cxx/mapped_file.h>
+#include <cxx/errors.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <type_traits>
+
+namespace cxx {
+
+// Binary images of FlatKDTree, which are mapped and queried in place, and the
+// external memory build that writes them.  Kept apart from cxx/2dtree.h so that
+// in-memory trees do not pull in the file mapping and stream headers.
+// FlatKDTree::save, load and build_image forward here.
+template<class POINT, int Dims>
+class FlatKDTreeImage
+{
+  typedef FlatKDTree<POINT,Dims> tree_type;
+  typedef POINT point;
+  typedef typename POINT::value_type value_type;
+  typedef KDCoords<POINT,Dims> coords;
+  typedef std::vector<point> point_vec;
+  typedef std::vector<value_type> value_vec;
+  typedef std::vector<char> flag_vec;
+
+  // Image file layout: the header, then the split values, the coordinates of
+  // each axis, the points and the erase flags, each section 64 byte aligned.
+  struct ImageHeader
+  {
+    char     magic[8];
+    uint32_t version;
+    uint32_t dims;
+    uint32_t value_size;
+    uint32_t point_size;
+    uint64_t bucket;
+    uint64_t size;
+  };
+
+  enum { IMAGE_VERSION = 1, IMAGE_SECTIONS = Dims + 3 };
+
+  static const char* image_magic() { return "CXXKDTR"; }
+
+  static ImageHeader image_header(size_t bucket, size_t n)
+  {
+    ImageHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, image_magic(), sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.dims = Dims;
+    header.value_size = sizeof(value_type);
+    header.point_size = sizeof(point);
+    header.bucket = bucket;
+    header.size = n;
+    return header;
+  }
+
+  // Fills the offset and size of every section of an image holding n points,
+  // and returns the total image size
+  static size_t image_layout(size_t n, size_t* offsets, size_t* sizes)
+  {
+    sizes[0] = n * sizeof(value_type);
+    for (int axe = 0; axe < Dims; ++axe) sizes[1 + axe] = n * sizeof(value_type);
+    sizes[Dims + 1] = n * sizeof(point);
+    sizes[Dims + 2] = n;
+    size_t offset = sizeof(ImageHeader);
+    for (int i = 0; i < IMAGE_SECTIONS; ++i)
+    {
+      offset = (offset + 63) & ~size_t(63);
+      offsets[i] = offset;
+      offset += sizes[i];
+    }
+    return offset;
+  }
+
+  // Out of core image builder.  A range of the tree larger than the memory limit is
+  // kept in a file of its points.  Its median is selected by streaming over the file,
+  // then the file is partitioned into one file per half, down to ranges that fit in
+  // memory, which are built there and written to their slices of the image.
+  class ExternalBuilder
+  {
+    // Selection key: the coordinate, then the position in the range file, so keys are distinct
+    typedef std::pair<value_type, size_t> key;
+    typedef std::vector<key> key_vec;
+
+    enum { SAMPLE = 4096 };
+
+    xstring            m_Target;
+    std::fstream       m_Image;
+    size_t             m_Offsets[IMAGE_SECTIONS];
+    size_t             m_Memory;
+    size_t             m_Bucket;
+    size_t             m_Files;
+    std::vector<point> m_Buffer;
+
+    // Calls f(point, position) for every point of file
+    template<class F>
+    void scan(const xstring& file, F f)
+    {
+      std::ifstream in(file, std::ios::binary);
+      if (!in) THROW_ERROR("Failed to open " << file);
+      size_t pos = 0;
+      while (in)
+      {
+        in.read((char*)&m_Buffer[0], m_Buffer.size() * sizeof(point));
+        size_t n = size_t(in.gcount()) / sizeof(point);
+        for (size_t i = 0; i < n; ++i, ++pos)
+          f(m_Buffer[i], pos);
+      }
+    }
+
+    void write(int section, size_t offset, const void* data, size_t bytes)
+    {
+      m_Image.seekp(std::streamoff(m_Offsets[section] + offset));
+      m_Image.write((const char*)data, bytes);
+      if (!m_Image) THROW_ERROR("Failed to write " << m_Target);
+    }
+
+    xstring temp_file()
+    {
+      xstring name;
+      name << m_Target << ".part" << m_Files++;
+      return name;
+    }
+
+    // Key of rank k along axe among the n points of file.  Each pass counts the points
+    // below, between and above two pivots taken from a sample of the previous pass,
+    // and keeps the middle part when it fits in memory.
+    key select(const xstring& file, size_t n, size_t k, int axe)
+    {
+      key lo, hi;
+      bool has_lo = false, has_hi = false;
+      size_t count = n;
+      key_vec sample, keep;
+      std::mt19937_64 rng(n);
+      for (;;)
+      {
+        key a, b;
+        bool split_lo = false, split_hi = false;
+        if (sample.size() >= SAMPLE)
+        {
+          std::sort(sample.begin(), sample.end());
+          double r = double(k) / count * sample.size(), d = 2 * std::sqrt(double(sample.size())) + 1;
+          if (r - d > 0) { a = sample[size_t(r - d)]; split_lo = true; }
+          if (r + d < sample.size()) { b = sample[size_t(r + d)]; split_hi = true; }
+        }
+        size_t below = 0, middle = 0;
+        sample.clear();
+        keep.clear();
+        scan(file, [&](const point& p, size_t pos)
+        {
+          key c(coords::get(p, axe), pos);
+          if ((has_lo && c < lo) || (has_hi && !(c < hi))) return;
+          if (split_lo && c < a) { ++below; return; }
+          if (split_hi && !(c < b)) return;
+          if (keep.size() <= m_Memory) keep.push_back(c);
+          if (sample.size() < SAMPLE) sample.push_back(c);
+          else
+          {
+            size_t j = size_t(rng() % (middle + 1));
+            if (j < SAMPLE) sample[j] = c;
+          }
+          ++middle;
+        });
+        if (k < below)
+        {
+          hi = a;
+          has_hi = true;
+          count = below;
+          sample.clear();
+        }
+        else
+        if (k < below + middle)
+        {
+          k -= below;
+          count = middle;
+          if (split_lo) { lo = a; has_lo = true; }
+          if (split_hi) { hi = b; has_hi = true; }
+          if (middle <= m_Memory)
+          {
+            std::nth_element(keep.begin(), keep.begin() + k, keep.end());
+            return keep[k];
+          }
+        }
+        else
+        {
+          k -= below + middle;
+          count -= below + middle;
+          lo = b;
+          has_lo = true;
+          sample.clear();
+        }
+      }
+    }
+
+    // Builds the range [b,e) of the tree, whose points are in file
+    void build(const xstring& file, bool temp, size_t b, size_t e, int depth)
+    {
+      size_t n = e - b;
+      if (n <= m_Memory)
+      {
+        tree_type tree(m_Bucket);
+        tree.m_PointsData.reserve(n);
+        scan(file, [&tree](const point& p, size_t) { tree.m_PointsData.push_back(p); });
+        if (temp) std::remove(file);
+        if (tree.m_PointsData.size() != n) THROW_ERROR("Failed to read " << file);
+        tree.m_SplitData.assign(n, value_type());
+        for (int axe = 0; axe < Dims; ++axe) tree.m_CoordsData[axe].resize(n);
+        tree.build(0, n, depth);
+        tree.fill_coords(0, n);
+        // The first split slot of a range belongs to an ancestor
+        if (n > 1) write(0, (b + 1) * sizeof(value_type), &tree.m_SplitData[1], (n - 1) * sizeof(value_type));
+        for (int axe = 0; axe < Dims; ++axe)
+          write(1 + axe, b * sizeof(value_type), &tree.m_CoordsData[axe][0], n * sizeof(value_type));
+        write(Dims + 1, b * sizeof(point), &tree.m_PointsData[0], n * sizeof(point));
+        return;
+      }
+      size_t m = b + n / 2;
+      int axe = depth % Dims;
+      key median = select(file, n, m - b, axe);
+      write(0, m * sizeof(value_type), &median.first, sizeof(value_type));
+      xstring left = temp_file(), right = temp_file();
+      {
+        std::ofstream lf(left, std::ios::binary), rf(right, std::ios::binary);
+        if (!lf || !rf) THROW_ERROR("Failed to create " << left);
+        scan(file, [&](const point& p, size_t pos)
+        {
+          if (key(coords::get(p, axe), pos) < median) lf.write((const char*)&p, sizeof(point));
+          else rf.write((const char*)&p, sizeof(point));
+        });
+        if (!lf || !rf) THROW_ERROR("Failed to write " << left);
+      }
+      if (temp) std::remove(file);
+      build(left, true, b, m, depth + 1);
+      build(right, true, m, e, depth + 1);
+    }
+  public:
+    ExternalBuilder(const xstring& target, size_t memory, size_t bucket)
+    : m_Target(target)
+    , m_Memory(std::max<size_t>(memory, 4 * SAMPLE))
+    , m_Bucket(bucket)
+    , m_Files(0)
+    , m_Buffer(std::min<size_t>(m_Memory, 1 << 16))
+    {}
+
+    void run(const xstring& points_file)
+    {
+      size_t n = 0;
+      {
+        std::ifstream in(points_file, std::ios::binary | std::ios::ate);
+        if (!in) THROW_ERROR("Failed to open " << points_file);
+        size_t bytes = size_t(in.tellg());
+        if (bytes % sizeof(point) != 0) THROW_ERROR("Invalid points file " << points_file);
+        n = bytes / sizeof(point);
+      }
+      size_t sizes[IMAGE_SECTIONS];
+      size_t total = image_layout(n, m_Offsets, sizes);
+      {
+        // Sized up front, so the erase flags read as zero
+        std::ofstream f(m_Target, std::ios::binary);
+        if (!f) THROW_ERROR("Failed to create " << m_Target);
+        ImageHeader header = image_header(m_Bucket, n);
+        f.write((const char*)&header, sizeof(header));
+        if (total > sizeof(header))
+        {
+          f.seekp(std::streamoff(total - 1));
+          f.put(0);
+        }
+        if (!f) THROW_ERROR("Failed to write " << m_Target);
+      }
+      m_Image.open(m_Target, std::ios::binary | std::ios::in | std::ios::out);
+      if (!m_Image) THROW_ERROR("Failed to open " << m_Target);
+      if (n > 0) build(points_file, false, 0, n, 0);
+    }
+  };
+public:
+  // Writes the tree, including erase flags, as a binary image that load() can map.
+  // Images are only portable between hosts with the same type layouts and endianness.
+  static void save(const tree_type& tree, const xstring& filename)
+  {
+    static_assert(std::is_trivially_copyable<point>::value, "Tree images require trivially copyable points");
+    ImageHeader header = image_header(tree.m_Bucket, tree.m_Size);
+    size_t offsets[IMAGE_SECTIONS], sizes[IMAGE_SECTIONS];
+    image_layout(tree.m_Size, offsets, sizes);
+    const char* sections[IMAGE_SECTIONS];
+    sections[0] = (const char*)tree.m_Split;
+    for (int axe = 0; axe < Dims; ++axe) sections[1 + axe] = (const char*)tree.m_Coords[axe];
+    sections[Dims + 1] = (const char*)tree.m_Points;
+    sections[Dims + 2] = tree.m_Erased;
+    std::ofstream f(filename, std::ios::binary);
+    if (!f) THROW_ERROR("Failed to create " << filename);
+    f.write((const char*)&header, sizeof(header));
+    size_t offset = sizeof(header);
+    for (int i = 0; i < IMAGE_SECTIONS; ++i)
+    {
+      for (; offset < offsets[i]; ++offset) f.put(0);
+      if (sizes[i] > 0) f.write(sections[i], sizes[i]);
+      offset += sizes[i];
+    }
+    if (!f) THROW_ERROR("Failed to write " << filename);
+  }
+
+  // Maps an image written by save() and queries it in place, without deserializing.
+  // Pages are shared with other processes mapping the same image; erasing points
+  // only affects this process.
+  static void load(tree_type& tree, const xstring& filename)
+  {
+    static_assert(std::is_trivially_copyable<point>::value, "Tree images require trivially copyable points");
+    mapped_file_ptr image(new MappedFile(filename));
+    if (image->size() < sizeof(ImageHeader)) THROW_ERROR("Invalid tree image " << filename);
+    ImageHeader header;
+    std::memcpy(&header, image->data(), sizeof(header));
+    if (std::memcmp(header.magic, image_magic(), sizeof(header.magic)) != 0 || header.version != IMAGE_VERSION)
+      THROW_ERROR("Invalid tree image " << filename);
+    if (header.dims != Dims || header.value_size != sizeof(value_type) || header.point_size != sizeof(point))
+      THROW_ERROR("Tree image " << filename << " does not match the tree type");
+    if (header.bucket < 1 || header.bucket > tree_type::MAX_BUCKET) THROW_ERROR("Invalid tree image " << filename);
+    // Bounds the point count by the file size before the layout multiplies it out
+    if (header.size > image->size() / (sizeof(point) + (Dims + 1) * sizeof(value_type) + 1))
+      THROW_ERROR("Truncated tree image " << filename);
+    size_t n = size_t(header.size);
+    size_t offsets[IMAGE_SECTIONS], sizes[IMAGE_SECTIONS];
+    if (image_layout(n, offsets, sizes) > image->size()) THROW_ERROR("Truncated tree image " << filename);
+    for (int axe = 0; axe < Dims; ++axe) value_vec().swap(tree.m_CoordsData[axe]);
+    value_vec().swap(tree.m_SplitData);
+    point_vec().swap(tree.m_PointsData);
+    flag_vec().swap(tree.m_ErasedData);
+    char* base = image->data();
+    tree.m_Image = image;
+    tree.m_Size = n;
+    tree.m_Bucket = size_t(header.bucket);
+    tree.m_Split = (const value_type*)(base + offsets[0]);
+    for (int axe = 0; axe < Dims; ++axe) tree.m_Coords[axe] = (const value_type*)(base + offsets[1 + axe]);
+    tree.m_Points = (const point*)(base + offsets[Dims + 1]);
+    tree.m_Erased = base + offsets[Dims + 2];
+  }
+
+  // External memory build, for point sets larger than memory.  Builds the tree over
+  // points_file, a raw array of points, and writes it to image_file for load(), which
+  // then pages in only the parts touched by queries.  At most memory_points points are
+  // held in memory at a time; larger ranges are partitioned through temporary files
+  // next to image_file.  Splits are the same as those of build(), though points with
+  // equal coordinates may be ordered differently.
+  static void build(const xstring& points_file, const xstring& image_file, 
+                    size_t memory_points=(1 << 22), size_t bucket_size=8)
+  {
+    static_assert(std::is_trivially_copyable<point>::value, "Tree images require trivially copyable points");
+    ExternalBuilder builder(image_file, memory_points, tree_type(bucket_size).bucket_size());
+    builder.run(points_file);
+  }
+};
+
+} // namespace cxx
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <memory>
+#include <cxx/errors.h>
+
+#ifdef _WIN32
+// Keeps windows.h from defining min and max macros, which break std::min and std::max
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace cxx {
+
+// Read only file mapping.  Pages are mapped copy-on-write, so writes through data()
+// stay private to the process, while unmodified pages are shared with any other
+// process mapping the same file.
+class MappedFile
+{
+  char*  m_Data;
+  size_t m_Size;
+#ifdef _WIN32
+  HANDLE m_File;
+  HANDLE m_Mapping;
+#endif
+
+  MappedFile(const MappedFile&);
+  MappedFile& operator= (const MappedFile&);
+public:
+  MappedFile(const xstring& filename)
+  : m_Data(0)
+  , m_Size(0)
+  {
+#ifdef _WIN32
+    m_File = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (m_File == INVALID_HANDLE_VALUE) THROW_ERROR("Failed to open " << filename);
+    LARGE_INTEGER size;
+    GetFileSizeEx(m_File, &size);
+    m_Size = size_t(size.QuadPart);
+    m_Mapping = CreateFileMappingA(m_File, 0, PAGE_WRITECOPY, 0, 0, 0);
+    if (m_Mapping) m_Data = (char*)MapViewOfFile(m_Mapping, FILE_MAP_COPY, 0, 0, 0);
+    if (!m_Data)
+    {
+      if (m_Mapping) CloseHandle(m_Mapping);
+      CloseHandle(m_File);
+      THROW_ERROR("Failed to map " << filename);
+    }
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) THROW_ERROR("Failed to open " << filename);
+    struct stat st;
+    if (fstat(fd, &st) == 0) m_Size = size_t(st.st_size);
+    void* p = (m_Size > 0 ? mmap(0, m_Size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED);
+    close(fd);
+    if (p == MAP_FAILED) THROW_ERROR("Failed to map " << filename);
+    m_Data = (char*)p;
+#endif
+  }
+
+  ~MappedFile()
+  {
+#ifdef _WIN32
+    UnmapViewOfFile(m_Data);
+    CloseHandle(m_Mapping);
+    CloseHandle(m_File);
+#else
+    munmap(m_Data, m_Size);
+#endif
+  }
+
+  char*  data() { return m_Data; }
+  size_t size() const { return m_Size; }
+};
+
+typedef std::shared_ptr<MappedFile> mapped_file_ptr;
+
+} // namespace cxx
@@ -1,7 +1,9 @@
 #pragma once
 
 #include <vector>
+#include <array>
 #include <limits>
+#include <algorithm>
 #include <functional>
 
 namespace cxx {
@@ -59,6 +61,38 @@ public:
     }
   }
 
+  // Combines the results of rhs, which has the same k and predicate, into these.
+  // Both lists are sorted, so this is a linear merge, preferring these on ties.
+  void merge(const Optimizer& rhs)
+  {
+    if (rhs.empty) return;
+    if (empty)
+    {
+      *this = rhs;
+      return;
+    }
+    size_t k = best.size(), i = 0, j = 0;
+    value_type_vec merged;
+    score_type_vec merged_score;
+    merged.reserve(k);
+    merged_score.reserve(k);
+    while (merged.size() < k)
+    {
+      if (j >= rhs.best.size() || (i < k && !pred(rhs.best_score[j], best_score[i])))
+      {
+        merged.push_back(best[i]);
+        merged_score.push_back(best_score[i++]);
+      }
+      else
+      {
+        merged.push_back(rhs.best[j]);
+        merged_score.push_back(rhs.best_score[j++]);
+      }
+    }
+    best.swap(merged);
+    best_score.swap(merged_score);
+  }
+
   bool found() const { return !empty; }
 
   const T& get_best() const 
@@ -82,6 +116,170 @@ public:
   }
 };
 
+// Keeps the same k best as Optimizer in a bounded heap, with the worst of them on top,
+// so adding a candidate is O(log k) instead of O(k).  Suited to large k.
+// Storage is reserved once, and set_best_score resets it for reuse across searches.
+template<class T, class D = double, class PRED=std::less<D>>
+class HeapOptimizer
+{
+  typedef std::pair<D,T> entry;
+  typedef std::vector<entry> entry_vec;
+
+  struct entry_pred
+  {
+    PRED pred;
+    bool operator() (const entry& a, const entry& b) const { return pred(a.first, b.first); }
+  };
+
+  size_t     k;
+  bool       empty;
+  D          bound;
+  entry_vec  heap;
+  entry_pred pred;
+  mutable entry_vec sorted; // Results best first, reusing its storage between searches
+
+  // Sorts the results, with the unfilled places holding the bound
+  void sort() const
+  {
+    sorted.assign(heap.begin(), heap.end());
+    std::sort_heap(sorted.begin(), sorted.end(), pred);
+    sorted.resize(k, entry(bound, T()));
+  }
+public:
+  HeapOptimizer(int K=1) 
+  : k(K)
+  , empty(true)
+  , bound(std::numeric_limits<D>::max())
+  {
+    heap.reserve(k);
+    sorted.reserve(k);
+  }
+
+  void set_best_score(const D& s) 
+  { 
+    heap.clear();
+    bound = s;
+    empty = false;
+  }
+
+  void add(const T& value, const D& score)
+  {
+    empty = false;
+    if (heap.size() < k)
+    {
+      if (!pred.pred(score, bound)) return;
+      heap.push_back(entry(score, value));
+      std::push_heap(heap.begin(), heap.end(), pred);
+    }
+    else
+    if (pred.pred(score, heap.front().first))
+    {
+      std::pop_heap(heap.begin(), heap.end(), pred);
+      heap.back() = entry(score, value);
+      std::push_heap(heap.begin(), heap.end(), pred);
+    }
+  }
+
+  // Adds the results of rhs, which has the same k and predicate
+  void merge(const HeapOptimizer& rhs)
+  {
+    if (rhs.empty) return;
+    empty = false;
+    for (size_t i = 0; i < rhs.heap.size(); ++i)
+      add(rhs.heap[i].second, rhs.heap[i].first);
+  }
+
+  bool found() const { return !empty; }
+
+  // The k-th best, as Optimizer::get_best
+  T get_best() const 
+  { 
+    return heap.size() == k && k > 0 ? heap.front().second : T();
+  }
+
+  // Bound for new candidates: the k-th best score once k were found
+  const D& get_best_score() const 
+  { 
+    return heap.size() == k && k > 0 ? heap.front().first : bound;
+  }
+
+  void get_best_scores(D* scores) const
+  {
+    sort();
+    for (size_t i = 0; i < k; ++i) scores[i] = sorted[i].first;
+  }
+
+  void get_best(T* all) const 
+  { 
+    sort();
+    for (size_t i = 0; i < k; ++i) all[i] = sorted[i].second;
+  }
+};
+
+// Optimizer for a number of results K fixed at compile time.  The results are kept
+// sorted in arrays, so small k searches need no allocation.
+template<class T, int K, class D = double, class PRED=std::less<D>>
+class FixedOptimizer
+{
+  static_assert(K > 0, "FixedOptimizer needs at least one result");
+
+  bool               empty;
+  std::array<T,K>    best;
+  std::array<D,K>    best_score;
+  PRED               pred;
+public:
+  FixedOptimizer() 
+  : empty(true)
+  {
+    best.fill(T());
+    best_score.fill(std::numeric_limits<D>::max());
+  }
+
+  void set_best_score(const D& s) 
+  { 
+    best_score.fill(s);
+    empty = false; 
+  }
+
+  void add(const T& value, const D& score)
+  {
+    empty = false;
+    if (!pred(score, best_score[K - 1])) return;
+    int i = K - 1;
+    for (; i > 0 && pred(score, best_score[i - 1]); --i)
+    {
+      best_score[i] = best_score[i - 1];
+      best[i] = best[i - 1];
+    }
+    best_score[i] = score;
+    best[i] = value;
+  }
+
+  // Adds the results of rhs, which has the same predicate
+  void merge(const FixedOptimizer& rhs)
+  {
+    if (rhs.empty) return;
+    empty = false;
+    for (int i = 0; i < K && pred(rhs.best_score[i], best_score[K - 1]); ++i)
+      add(rhs.best[i], rhs.best_score[i]);
+  }
+
+  bool found() const { return !empty; }
+
+  const T& get_best() const { return best[K - 1]; }
+
+  const D& get_best_score() const { return best_score[K - 1]; }
+
+  void get_best_scores(D* scores) const
+  {
+    std::copy(best_score.begin(), best_score.end(), scores);
+  }
+
+  void get_best(T* all) const 
+  { 
+    std::copy(best.begin(), best.end(), all); 
+  }
+};
 
 } // namespace cxx
 
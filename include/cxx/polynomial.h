@@ -3,6 +3,12 @@
 #include <cxx/errors.h>
 #include <cxx/prims.h>
 #include <assert.h>
+#include <vector>
+#include <complex>
+#include <cmath>
+#include <algorithm>
+#include <type_traits>
+#include <utility>
 
 // For a high precision scalar, use the following includes:
 //    #include <boost/math/constants/constants.hpp>
@@ -12,8 +18,115 @@
 
 namespace cxx {
   
+  // Horner's rule over arrays of points.  Points are processed in blocks, with the
+  // coefficient loop outside the point loop, so the inner loop is an independent
+  // multiply-add per point that the compiler vectorizes.  The last block is padded
+  // so the inner loops always have the constant BLOCK length, which lets -O2
+  // vectorize them without a remainder loop.  The derivative is carried along in
+  // the same pass.
+  // Computes y = ys * p(xs * x) and dy = ys * xs * p'(xs * x), for the nc coefficients c
+  template<class T>
+  struct PolynomialHorner
+  {
+    enum { BLOCK = 64 };
+
+    static void evaluate(const T* c, size_t nc, const double* x, double* y, size_t n, double* dy=0,
+                         const T& xs=T(1), const T& ys=T(1))
+    {
+      T xb[BLOCK], p[BLOCK], d[BLOCK];
+      for (size_t b = 0; b < n; b += BLOCK)
+      {
+        size_t m = std::min<size_t>(BLOCK, n - b);
+        for (size_t j = 0; j < BLOCK; ++j)
+        {
+          xb[j] = (j < m ? T(x[b + j]) * xs : T(0));
+          p[j] = c[nc - 1];
+          d[j] = T(0);
+        }
+        if (dy)
+        {
+          for (size_t i = nc - 1; i > 0; --i)
+          {
+            for (size_t j = 0; j < BLOCK; ++j)
+              d[j] = d[j] * xb[j] + p[j];
+            for (size_t j = 0; j < BLOCK; ++j)
+              p[j] = p[j] * xb[j] + c[i - 1];
+          }
+          for (size_t j = 0; j < m; ++j)
+            dy[b + j] = double(ys * xs * d[j]);
+        }
+        else
+        {
+          for (size_t i = nc - 1; i > 0; --i)
+            for (size_t j = 0; j < BLOCK; ++j)
+              p[j] = p[j] * xb[j] + c[i - 1];
+        }
+        for (size_t j = 0; j < m; ++j)
+          y[b + j] = double(ys * p[j]);
+      }
+    }
+  };
+
+  template<class T> class Polynomial;
+  template<class T, int D> class FixedPolynomial;
+
+  // Base of polynomial expressions.  The arithmetic operators return expression
+  // objects instead of polynomials; converting one to a Polynomial allocates the
+  // result once, from degree(), then each term adds itself into it with add_to.
+  // Expressions refer to their named Polynomial operands, so they should not outlive
+  // them.  The members below evaluate the expression into a Polynomial first.
+  template<class T, class E>
+  struct PolynomialExpr
+  {
+    typedef T real;
+    const E& self() const { return static_cast<const E&>(*this); }
+
+    double evaluate(double x) const;
+    void   evaluate(const double* x, double* y, size_t n, double* dy=0) const;
+    real   operator[] (size_t index) const;
+    Polynomial<T> derivative() const;
+  };
+
+  // Storage of an operand from the type its forwarding reference was deduced as:
+  // named polynomials by reference, temporary ones and sub-expressions by value
+  template<class X>
+  struct PolynomialOperand { typedef const typename std::decay<X>::type type; };
+
+  template<class T>
+  struct PolynomialOperand<Polynomial<T>&> { typedef const Polynomial<T>& type; };
+
+  template<class T>
+  struct PolynomialOperand<const Polynomial<T>&> { typedef const Polynomial<T>& type; };
+
+  // Scalar type of the expression type X, missing when X is not an expression
+  template<class X, class = void>
+  struct PolynomialExprType {};
+
+  template<class X>
+  struct PolynomialExprType<X, typename std::enable_if<std::is_base_of<PolynomialExpr<typename X::real, X>, X>::value>::type>
+  { typedef typename X::real real; };
+
+  template<class X>
+  struct PolynomialIsFixed : std::false_type {};
+
+  template<class T, int D>
+  struct PolynomialIsFixed<FixedPolynomial<T,D>> : std::true_type {};
+
+  // Scalar type of the expression operators on the decayed operand types, missing
+  // when they do not apply; operations on fixed polynomials alone are left to the
+  // FixedPolynomial operators
+  template<class A, class B, class = void>
+  struct PolynomialBinaryOp {};
+
+  template<class A, class B>
+  struct PolynomialBinaryOp<A, B, typename std::enable_if<std::is_same<typename PolynomialExprType<A>::real, typename PolynomialExprType<B>::real>::value && !(PolynomialIsFixed<A>::value && PolynomialIsFixed<B>::value)>::type>
+  { typedef typename PolynomialExprType<A>::real real; };
+
+  template<class A>
+  struct PolynomialUnaryOp : PolynomialBinaryOp<A,A> {};
+
   template<class T=double>
-  class Polynomial
+  class Polynomial : public PolynomialExpr<T, Polynomial<T>>
   {
   public:
     typedef T real;
@@ -37,8 +150,35 @@ namespace cxx {
     : m_Coefficients(degree + 1, default_value)
     {}
 
+    template<class E>
+    Polynomial(const PolynomialExpr<T,E>& e)
+    : m_Coefficients(e.self().degree() + 1, real(0))
+    {
+      e.self().add_to(data(), real(1));
+    }
+
+    // The expression may refer to this polynomial, so it is evaluated into new storage
+    template<class E>
+    self& operator= (const PolynomialExpr<T,E>& e)
+    {
+      self res(e);
+      m_Coefficients.swap(res.m_Coefficients);
+      return *this;
+    }
+
     size_t degree() const { return m_Coefficients.size() - 1; }
+
+    // Coefficients from low rank to high, degree()+1 of them
+    const real* data() const { return m_Coefficients.data(); }
+    real*       data()       { return m_Coefficients.data(); }
     
+    // Adds scale times this polynomial to res[0 .. degree()]
+    void add_to(real* res, const real& scale) const
+    {
+      for (size_t i = 0; i <= degree(); ++i)
+        res[i] += scale * m_Coefficients[i];
+    }
+
     self& operator+= (const self& rhs)
     {
       if (rhs.degree() > degree()) set_degree(rhs.degree());
@@ -49,7 +189,46 @@ namespace cxx {
     
     self& operator-= (const self& rhs)
     {
-      return *this += (-rhs);
+      if (rhs.degree() > degree()) set_degree(rhs.degree());
+      for (size_t i = 0; i <= rhs.degree(); ++i) 
+        m_Coefficients[i]-=rhs[i];
+      return *this;
+    }
+
+    template<class E>
+    self& operator+= (const PolynomialExpr<T,E>& e)
+    {
+      return *this = *this + e.self();
+    }
+
+    template<class E>
+    self& operator-= (const PolynomialExpr<T,E>& e)
+    {
+      return *this = *this - e.self();
+    }
+
+    self& operator+= (const real& scalar)
+    {
+      m_Coefficients[0]+=scalar;
+      return *this;
+    }
+
+    self& operator-= (const real& scalar)
+    {
+      m_Coefficients[0]-=scalar;
+      return *this;
+    }
+
+    self& operator*= (const real& scalar)
+    {
+      for (size_t i = 0; i <= degree(); ++i)
+        m_Coefficients[i]*=scalar;
+      return *this;
+    }
+
+    self& operator/= (const real& scalar)
+    {
+      return *this *= real(1.0 / scalar);
     }
 
     self& operator*= (const self& rhs)
@@ -62,22 +241,16 @@ namespace cxx {
 
     double evaluate(double x) const
     {
-      real sum = m_Coefficients[0];
-      real xp=x;
-      for (size_t i = 1; i <= degree(); ++i)
-      {
-        sum += xp * m_Coefficients[i];
-        xp*=x;
-      }
+      real sum = m_Coefficients[degree()];
+      for (size_t i = degree(); i > 0; --i)
+        sum = sum * x + m_Coefficients[i - 1];
       return double(sum);
     }
-    
-    self operator- () const
+
+    // Evaluates at the n points x into y, and the derivative into dy when given
+    void evaluate(const double* x, double* y, size_t n, double* dy=0) const
     {
-      Polynomial res=*this;
-      for(size_t i=0; i<=degree(); ++i)
-        res[i]=-res[i];
-      return res;
+      PolynomialHorner<T>::evaluate(data(), degree() + 1, x, y, n, dy);
     }
 
     real& operator[] (size_t index)
@@ -126,92 +299,571 @@ namespace cxx {
     return os;
   }
 
-  template<class T>
-  inline Polynomial<T> operator/ (const Polynomial<T>& p, typename Polynomial<T>::real scalar)
+  template<class T, class E>
+  inline std::ostream& operator<< (std::ostream& os, const PolynomialExpr<T,E>& e)
+  {
+    return os << Polynomial<T>(e);
+  }
+
+  template<class T, class E>
+  inline double PolynomialExpr<T,E>::evaluate(double x) const
+  {
+    return Polynomial<T>(*this).evaluate(x);
+  }
+
+  template<class T, class E>
+  inline void PolynomialExpr<T,E>::evaluate(const double* x, double* y, size_t n, double* dy) const
+  {
+    Polynomial<T>(*this).evaluate(x, y, n, dy);
+  }
+
+  template<class T, class E>
+  inline T PolynomialExpr<T,E>::operator[] (size_t index) const
+  {
+    return Polynomial<T>(*this)[index];
+  }
+
+  template<class T, class E>
+  inline Polynomial<T> PolynomialExpr<T,E>::derivative() const
   {
-    return (1.0 / scalar)*p;
+    return Polynomial<T>(*this).derivative();
   }
 
+  // Product kernels over coefficient arrays.  Each adds the product of a (na
+  // coefficients) and b (nb coefficients) to res[0 .. na+nb-1).
+  // The schoolbook product, used by operator*, keeps every coefficient accurate
+  // relative to itself.  multiply picks a faster kernel by size: Karatsuba above
+  // KARATSUBA_MIN coefficients, and for float and double coefficients an FFT product
+  // above FFT_MIN.  Both have rounding errors relative to the largest coefficients,
+  // so small coefficients of factors with a wide range of magnitudes lose their
+  // accuracy; multiply is only used when requested, through fast_multiply.
   template<class T>
-  inline Polynomial<T> operator* (const Polynomial<T>& a, const Polynomial<T>& b)
+  struct PolynomialProduct
   {
-    size_t da = a.degree(), db = b.degree();
-    Polynomial<T> res(da + db, 0.0);
-    for (size_t i = 0; i <= da; ++i)
+    enum { KARATSUBA_MIN = 32, FFT_MIN = 1024 };
+
+    // Adds scale times the product
+    static void schoolbook(const T* a, size_t na, const T* b, size_t nb, T* res, const T& scale=T(1))
     {
-      for (size_t j = 0; j <= db; ++j)
+      for (size_t i = 0; i < na; ++i)
       {
-        res[i + j] += a[i] * b[j];
+        T ai = scale * a[i];
+        for (size_t j = 0; j < nb; ++j)
+          res[i + j] += ai * b[j];
+      }
+    }
+
+    // With a = a0 + a1*x^m and b = b0 + b1*x^m, the middle term a0*b1 + a1*b0 is
+    // (a0+a1)*(b0+b1) - a0*b0 - a1*b1, so three half size products replace four
+    static void karatsuba(const T* a, size_t na, const T* b, size_t nb, T* res)
+    {
+      if (na < nb)
+      {
+        std::swap(a, b);
+        std::swap(na, nb);
+      }
+      if (nb < KARATSUBA_MIN)
+      {
+        schoolbook(a, na, b, nb, res);
+        return;
+      }
+      size_t m = (na + 1) / 2;
+      if (nb <= m)
+      {
+        // Unbalanced: multiply b by slices of a as long as b
+        for (size_t i = 0; i < na; i += nb)
+          karatsuba(a + i, std::min(nb, na - i), b, nb, res + i);
+        return;
+      }
+      size_t na1 = na - m, nb1 = nb - m;
+      std::vector<T> z0(2 * m - 1, T(0)), z2(na1 + nb1 - 1, T(0)), z1(2 * m - 1, T(0));
+      std::vector<T> sa(a, a + m), sb(b, b + m);
+      for (size_t i = 0; i < na1; ++i) sa[i] += a[m + i];
+      for (size_t i = 0; i < nb1; ++i) sb[i] += b[m + i];
+      karatsuba(a, m, b, m, &z0[0]);
+      karatsuba(a + m, na1, b + m, nb1, &z2[0]);
+      karatsuba(&sa[0], m, &sb[0], m, &z1[0]);
+      for (size_t i = 0; i < z0.size(); ++i)
+      {
+        res[i] += z0[i];
+        z1[i] -= z0[i];
+      }
+      for (size_t i = 0; i < z2.size(); ++i)
+      {
+        res[2 * m + i] += z2[i];
+        z1[i] -= z2[i];
+      }
+      for (size_t i = 0; i < z1.size(); ++i)
+        res[m + i] += z1[i];
+    }
+
+    static void fft(const T* a, size_t na, const T* b, size_t nb, T* res)
+    {
+      typedef std::complex<double> cplx;
+      size_t n = 1;
+      while (n < na + nb - 1) n <<= 1;
+      std::vector<cplx> fa(n), fb(n);
+      for (size_t i = 0; i < na; ++i) fa[i] = double(a[i]);
+      for (size_t i = 0; i < nb; ++i) fb[i] = double(b[i]);
+      transform(fa, false);
+      transform(fb, false);
+      for (size_t i = 0; i < n; ++i) fa[i] *= fb[i];
+      transform(fa, true);
+      for (size_t i = 0; i < na + nb - 1; ++i)
+        res[i] += T(fa[i].real() / double(n));
+    }
+
+    static void multiply(const T* a, size_t na, const T* b, size_t nb, T* res)
+    {
+      multiply(a, na, b, nb, res, std::integral_constant<bool, std::is_same<T,double>::value || std::is_same<T,float>::value>());
+    }
+  private:
+    static void multiply(const T* a, size_t na, const T* b, size_t nb, T* res, std::true_type)
+    {
+      if (std::min(na, nb) >= FFT_MIN) fft(a, na, b, nb, res);
+      else karatsuba(a, na, b, nb, res);
+    }
+
+    static void multiply(const T* a, size_t na, const T* b, size_t nb, T* res, std::false_type)
+    {
+      karatsuba(a, na, b, nb, res);
+    }
+
+    // In place radix 2 transform of a power of 2 size, unscaled.  Twiddles come from
+    // one table of exact roots rather than running products, which drift.
+    static void transform(std::vector<std::complex<double>>& v, bool inverse)
+    {
+      typedef std::complex<double> cplx;
+      size_t n = v.size();
+      for (size_t i = 1, j = 0; i < n; ++i)
+      {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) std::swap(v[i], v[j]);
+      }
+      double angle = 2 * std::acos(-1.0) / double(n) * (inverse ? -1 : 1);
+      std::vector<cplx> roots(n / 2);
+      for (size_t k = 0; k < n / 2; ++k) roots[k] = std::polar(1.0, angle * double(k));
+      for (size_t len = 2; len <= n; len <<= 1)
+      {
+        size_t half = len / 2, stride = n / len;
+        for (size_t i = 0; i < n; i += len)
+        {
+          for (size_t j = 0; j < half; ++j)
+          {
+            cplx u = v[i + j], t = v[i + j + half] * roots[j * stride];
+            v[i + j] = u + t;
+            v[i + j + half] = u - t;
+          }
+        }
       }
     }
+  };
+
+  // Coefficients of an expression operand: a polynomial is used in place, any other
+  // expression is evaluated into a temporary
+  template<class T, class E>
+  struct PolynomialCoefficients
+  {
+    Polynomial<T> m_Value;
+    PolynomialCoefficients(const E& e) : m_Value(e) {}
+    const Polynomial<T>& get() const { return m_Value; }
+  };
+
+  template<class T>
+  struct PolynomialCoefficients<T, Polynomial<T>>
+  {
+    const Polynomial<T>& m_Value;
+    PolynomialCoefficients(const Polynomial<T>& p) : m_Value(p) {}
+    const Polynomial<T>& get() const { return m_Value; }
+  };
+
+  // l + sign*r
+  template<class T, class L, class R>
+  class PolynomialSumExpr : public PolynomialExpr<T, PolynomialSumExpr<T,L,R>>
+  {
+    typename PolynomialOperand<L>::type m_Left;
+    typename PolynomialOperand<R>::type m_Right;
+    T                                   m_Sign;
+  public:
+    PolynomialSumExpr(L&& l, R&& r, const T& sign)
+    : m_Left(std::forward<L>(l))
+    , m_Right(std::forward<R>(r))
+    , m_Sign(sign)
+    {}
+
+    size_t degree() const { return std::max(m_Left.degree(), m_Right.degree()); }
+
+    void add_to(T* res, const T& scale) const
+    {
+      m_Left.add_to(res, scale);
+      m_Right.add_to(res, scale * m_Sign);
+    }
+  };
+
+  // scale*e + offset, covering the scalar operators and negation
+  template<class T, class E>
+  class PolynomialAffineExpr : public PolynomialExpr<T, PolynomialAffineExpr<T,E>>
+  {
+    typename PolynomialOperand<E>::type m_Expr;
+    T                                   m_Scale;
+    T                                   m_Offset;
+  public:
+    PolynomialAffineExpr(E&& e, const T& scale, const T& offset)
+    : m_Expr(std::forward<E>(e))
+    , m_Scale(scale)
+    , m_Offset(offset)
+    {}
+
+    size_t degree() const { return m_Expr.degree(); }
+
+    void add_to(T* res, const T& scale) const
+    {
+      m_Expr.add_to(res, scale * m_Scale);
+      res[0] += scale * m_Offset;
+    }
+  };
+
+  // l*r, by the schoolbook product, which adds straight into the result
+  template<class T, class L, class R>
+  class PolynomialProductExpr : public PolynomialExpr<T, PolynomialProductExpr<T,L,R>>
+  {
+    typename PolynomialOperand<L>::type m_Left;
+    typename PolynomialOperand<R>::type m_Right;
+  public:
+    PolynomialProductExpr(L&& l, R&& r)
+    : m_Left(std::forward<L>(l))
+    , m_Right(std::forward<R>(r))
+    {}
+
+    size_t degree() const { return m_Left.degree() + m_Right.degree(); }
+
+    void add_to(T* res, const T& scale) const
+    {
+      PolynomialCoefficients<T, typename std::decay<L>::type> a(m_Left);
+      PolynomialCoefficients<T, typename std::decay<R>::type> b(m_Right);
+      PolynomialProduct<T>::schoolbook(a.get().data(), a.get().degree() + 1, b.get().data(), b.get().degree() + 1, res, scale);
+    }
+  };
+
+  // Product by the fastest kernel for the sizes, Karatsuba or FFT (see PolynomialProduct).
+  // Much faster than operator* for long factors, but the error of every coefficient is
+  // relative to the largest ones, so it suits factors of similar magnitudes only.
+  template<class T, class L, class R>
+  inline Polynomial<T> fast_multiply(const PolynomialExpr<T,L>& a, const PolynomialExpr<T,R>& b)
+  {
+    PolynomialCoefficients<T,L> pa(a.self());
+    PolynomialCoefficients<T,R> pb(b.self());
+    size_t na = pa.get().degree() + 1, nb = pb.get().degree() + 1;
+    Polynomial<T> res(na + nb - 2, T(0));
+    PolynomialProduct<T>::multiply(pa.get().data(), na, pb.get().data(), nb, res.data());
     return res;
   }
 
-  template<class T>
-  inline Polynomial<T> operator+ (const Polynomial<T>& a, const Polynomial<T>& b)
+  // The operators take their operands by forwarding reference, so that the expression
+  // can tell temporary polynomials, which it keeps, from named ones
+  template<class L, class R, class T = typename PolynomialBinaryOp<typename std::decay<L>::type, typename std::decay<R>::type>::real>
+  inline PolynomialProductExpr<T,L,R> operator* (L&& a, R&& b)
   {
-    auto res=a;
-    return res+=b;
+    return PolynomialProductExpr<T,L,R>(std::forward<L>(a), std::forward<R>(b));
   }
 
-  template<class T>
-  inline Polynomial<T> operator- (const Polynomial<T>& a, const Polynomial<T>& b)
+  template<class L, class R, class T = typename PolynomialBinaryOp<typename std::decay<L>::type, typename std::decay<R>::type>::real>
+  inline PolynomialSumExpr<T,L,R> operator+ (L&& a, R&& b)
   {
-    return a+(-b);
+    return PolynomialSumExpr<T,L,R>(std::forward<L>(a), std::forward<R>(b), T(1));
+  }
+
+  template<class L, class R, class T = typename PolynomialBinaryOp<typename std::decay<L>::type, typename std::decay<R>::type>::real>
+  inline PolynomialSumExpr<T,L,R> operator- (L&& a, R&& b)
+  {
+    return PolynomialSumExpr<T,L,R>(std::forward<L>(a), std::forward<R>(b), T(-1));
+  }
+
+  template<class E, class T = typename PolynomialUnaryOp<typename std::decay<E>::type>::real>
+  inline PolynomialAffineExpr<T,E> operator- (E&& p)
+  {
+    return PolynomialAffineExpr<T,E>(std::forward<E>(p), T(-1), T(0));
   }
   
-  template<class T>
-  inline Polynomial<T> operator+ (const Polynomial<T>& p, typename Polynomial<T>::real scalar)
+  template<class E, class T = typename PolynomialUnaryOp<typename std::decay<E>::type>::real>
+  inline PolynomialAffineExpr<T,E> operator+ (E&& p, typename PolynomialUnaryOp<typename std::decay<E>::type>::real scalar)
   {
-    return p+Polynomial<T>(scalar);
+    return PolynomialAffineExpr<T,E>(std::forward<E>(p), T(1), scalar);
   }
 
-  template<class T>
-  inline Polynomial<T> operator+ (typename Polynomial<T>::real scalar, const Polynomial<T>& p)
+  template<class E, class T = typename PolynomialUnaryOp<typename std::decay<E>::type>::real>
+  inline PolynomialAffineExpr<T,E> operator+ (typename PolynomialUnaryOp<typename std::decay<E>::type>::real scalar, E&& p)
   {
-    return Polynomial<T>(scalar)+p;
+    return PolynomialAffineExpr<T,E>(std::forward<E>(p), T(1), scalar);
   }
 
-  template<class T>
-  inline Polynomial<T> operator- (const Polynomial<T>& p, typename Polynomial<T>::real scalar)
+  template<class E, class T = typename PolynomialUnaryOp<typename std::decay<E>::type>::real>
+  inline PolynomialAffineExpr<T,E> operator- (E&& p, typename PolynomialUnaryOp<typename std::decay<E>::type>::real scalar)
   {
-    return p-Polynomial<T>(scalar);
+    return PolynomialAffineExpr<T,E>(std::forward<E>(p), T(1), -scalar);
   }
 
-  template<class T>
-  inline Polynomial<T> operator- (typename Polynomial<T>::real scalar, const Polynomial<T>& p)
+  template<class E, class T = typename PolynomialUnaryOp<typename std::decay<E>::type>::real>
+  inline PolynomialAffineExpr<T,E> operator- (typename PolynomialUnaryOp<typename std::decay<E>::type>::real scalar, E&& p)
   {
-    return Polynomial<T>(scalar)-p;
+    return PolynomialAffineExpr<T,E>(std::forward<E>(p), T(-1), scalar);
   }
 
-  template<class T>
-  inline Polynomial<T> operator* (const Polynomial<T>& p, typename Polynomial<T>::real scalar)
+  template<class E, class T = typename PolynomialUnaryOp<typename std::decay<E>::type>::real>
+  inline PolynomialAffineExpr<T,E> operator* (E&& p, typename PolynomialUnaryOp<typename std::decay<E>::type>::real scalar)
   {
-    return p*Polynomial<T>(scalar);
+    return PolynomialAffineExpr<T,E>(std::forward<E>(p), scalar, T(0));
   }
 
-  template<class T>
-  inline Polynomial<T> operator* (typename Polynomial<T>::real scalar, const Polynomial<T>& p)
+  template<class E, class T = typename PolynomialUnaryOp<typename std::decay<E>::type>::real>
+  inline PolynomialAffineExpr<T,E> operator* (typename PolynomialUnaryOp<typename std::decay<E>::type>::real scalar, E&& p)
   {
-    return Polynomial<T>(scalar)*p;
+    return PolynomialAffineExpr<T,E>(std::forward<E>(p), scalar, T(0));
   }
 
+  template<class E, class T = typename PolynomialUnaryOp<typename std::decay<E>::type>::real>
+  inline PolynomialAffineExpr<T,E> operator/ (E&& p, typename PolynomialUnaryOp<typename std::decay<E>::type>::real scalar)
+  {
+    return PolynomialAffineExpr<T,E>(std::forward<E>(p), T(1.0 / scalar), T(0));
+  }
 
   // Important note: with C++ operator precedence, the ^ operator does not have a high priority,
   //                 so typical expressions such as    a*b^2  would be interpreted as:  (a*b)^2
   //                 Therefore, the overloaded function pow is used instead
-  template<class T>
-  inline Polynomial<T> pow(const Polynomial<T>& p, int power)
+  template<class T, class E>
+  inline Polynomial<T> pow(const PolynomialExpr<T,E>& p, int power)
   {
     if (power < 0) THROW_ERROR("Unsupported power: " << power);
     if (power == 0) return Polynomial<T>(1.0);
     if (power == 1) return p;
-    Polynomial<T> res = p;
-    while (--power > 0)
-      res = res*p;
+    // Repeated squaring: p^power is the product of the p^(2^i) for the bits i set in power
+    Polynomial<T> res(1.0), square = p;
+    for (;;)
+    {
+      if (power & 1) res = res*square;
+      power >>= 1;
+      if (power == 0) break;
+      square = square*square;
+    }
+    return res;
+  }
+
+  // Polynomial of degree D with its coefficients held in place, so it never allocates.
+  // Arithmetic between fixed polynomials yields fixed polynomials of the resulting
+  // degree, and like evaluation can run in constant expressions.  The coefficients
+  // are a built-in array since the mutating std::array accessors are not constexpr
+  // in C++14.
+  // A fixed polynomial is also a polynomial expression, so it mixes with Polynomial
+  // in expressions and converts to one; the explicit conversion back requires the
+  // coefficients above D to be zero.
+  template<class T, int D>
+  class FixedPolynomial : public PolynomialExpr<T, FixedPolynomial<T,D>>
+  {
+    static_assert(D >= 0, "FixedPolynomial needs a degree of at least 0");
+  public:
+    typedef T real;
+  private:
+    typedef FixedPolynomial<T,D> self;
+
+    // Coefficients from low rank (0) to high (degree)
+    real m_Coefficients[D + 1];
+  public:
+    constexpr FixedPolynomial(real scalar = 0.0)
+    : m_Coefficients{scalar}
+    {}
+
+    explicit FixedPolynomial(const Polynomial<T>& p)
+    : m_Coefficients{}
+    {
+      for (size_t i = 0; i <= p.degree(); ++i)
+      {
+        if (i <= size_t(D)) m_Coefficients[i] = p[i];
+        else if (p[i] != real(0)) THROW_ERROR("Polynomial of degree " << p.degree() << " does not fit degree " << D);
+      }
+    }
+
+    constexpr size_t degree() const { return D; }
+
+    const real* data() const { return m_Coefficients; }
+    real*       data()       { return m_Coefficients; }
+
+    constexpr real& operator[] (size_t index)
+    {
+      assert(index <= size_t(D));
+      return m_Coefficients[index];
+    }
+
+    constexpr real operator[] (size_t index) const
+    {
+      assert(index <= size_t(D));
+      return m_Coefficients[index];
+    }
+
+    // Adds scale times this polynomial to res[0 .. degree()]
+    void add_to(real* res, const real& scale) const
+    {
+      for (int i = 0; i <= D; ++i)
+        res[i] += scale * m_Coefficients[i];
+    }
+
+    template<int B>
+    constexpr self& operator+= (const FixedPolynomial<T,B>& rhs)
+    {
+      static_assert(B <= D, "Sum does not fit the degree");
+      for (int i = 0; i <= B; ++i)
+        m_Coefficients[i]+=rhs[i];
+      return *this;
+    }
+
+    template<int B>
+    constexpr self& operator-= (const FixedPolynomial<T,B>& rhs)
+    {
+      static_assert(B <= D, "Difference does not fit the degree");
+      for (int i = 0; i <= B; ++i)
+        m_Coefficients[i]-=rhs[i];
+      return *this;
+    }
+
+    constexpr self& operator+= (const real& scalar)
+    {
+      m_Coefficients[0]+=scalar;
+      return *this;
+    }
+
+    constexpr self& operator-= (const real& scalar)
+    {
+      m_Coefficients[0]-=scalar;
+      return *this;
+    }
+
+    constexpr self& operator*= (const real& scalar)
+    {
+      for (int i = 0; i <= D; ++i)
+        m_Coefficients[i]*=scalar;
+      return *this;
+    }
+
+    constexpr self& operator/= (const real& scalar)
+    {
+      return *this *= real(1.0 / scalar);
+    }
+
+    constexpr double evaluate(double x) const
+    {
+      real sum = m_Coefficients[D];
+      for (int i = D; i > 0; --i)
+        sum = sum * x + m_Coefficients[i - 1];
+      return double(sum);
+    }
+
+    // Evaluates at the n points x into y, and the derivative into dy when given
+    void evaluate(const double* x, double* y, size_t n, double* dy=0) const
+    {
+      PolynomialHorner<T>::evaluate(data(), D + 1, x, y, n, dy);
+    }
+
+    constexpr FixedPolynomial<T, (D > 0 ? D - 1 : 0)> derivative() const
+    {
+      FixedPolynomial<T, (D > 0 ? D - 1 : 0)> res;
+      for (int i = 0; i < D; ++i)
+        res[i] = (i + 1)*m_Coefficients[i + 1];
+      return res;
+    }
+  };
+
+  // Fixed polynomials are product operands as they are
+  template<class T, int D>
+  struct PolynomialCoefficients<T, FixedPolynomial<T,D>>
+  {
+    const FixedPolynomial<T,D>& m_Value;
+    PolynomialCoefficients(const FixedPolynomial<T,D>& p) : m_Value(p) {}
+    const FixedPolynomial<T,D>& get() const { return m_Value; }
+  };
+
+  template<class T, int A, int B>
+  constexpr FixedPolynomial<T, (A > B ? A : B)> operator+ (const FixedPolynomial<T,A>& a, const FixedPolynomial<T,B>& b)
+  {
+    FixedPolynomial<T, (A > B ? A : B)> res(a[0]);
+    for (int i = 1; i <= A; ++i) res[i] = a[i];
+    return res += b;
+  }
+
+  template<class T, int A, int B>
+  constexpr FixedPolynomial<T, (A > B ? A : B)> operator- (const FixedPolynomial<T,A>& a, const FixedPolynomial<T,B>& b)
+  {
+    FixedPolynomial<T, (A > B ? A : B)> res(a[0]);
+    for (int i = 1; i <= A; ++i) res[i] = a[i];
+    return res -= b;
+  }
+
+  template<class T, int A, int B>
+  constexpr FixedPolynomial<T, A + B> operator* (const FixedPolynomial<T,A>& a, const FixedPolynomial<T,B>& b)
+  {
+    FixedPolynomial<T, A + B> res;
+    for (int i = 0; i <= A; ++i)
+      for (int j = 0; j <= B; ++j)
+        res[i + j] += a[i] * b[j];
     return res;
   }
 
+  template<class T, int D>
+  constexpr FixedPolynomial<T,D> operator- (const FixedPolynomial<T,D>& p)
+  {
+    FixedPolynomial<T,D> res = p;
+    return res *= T(-1);
+  }
+
+  template<class T, int D>
+  constexpr FixedPolynomial<T,D> operator+ (const FixedPolynomial<T,D>& p, typename FixedPolynomial<T,D>::real scalar)
+  {
+    FixedPolynomial<T,D> res = p;
+    return res += scalar;
+  }
+
+  template<class T, int D>
+  constexpr FixedPolynomial<T,D> operator+ (typename FixedPolynomial<T,D>::real scalar, const FixedPolynomial<T,D>& p)
+  {
+    FixedPolynomial<T,D> res = p;
+    return res += scalar;
+  }
+
+  template<class T, int D>
+  constexpr FixedPolynomial<T,D> operator- (const FixedPolynomial<T,D>& p, typename FixedPolynomial<T,D>::real scalar)
+  {
+    FixedPolynomial<T,D> res = p;
+    return res -= scalar;
+  }
+
+  template<class T, int D>
+  constexpr FixedPolynomial<T,D> operator- (typename FixedPolynomial<T,D>::real scalar, const FixedPolynomial<T,D>& p)
+  {
+    FixedPolynomial<T,D> res = -p;
+    return res += scalar;
+  }
+
+  template<class T, int D>
+  constexpr FixedPolynomial<T,D> operator* (const FixedPolynomial<T,D>& p, typename FixedPolynomial<T,D>::real scalar)
+  {
+    FixedPolynomial<T,D> res = p;
+    return res *= scalar;
+  }
+
+  template<class T, int D>
+  constexpr FixedPolynomial<T,D> operator* (typename FixedPolynomial<T,D>::real scalar, const FixedPolynomial<T,D>& p)
+  {
+    FixedPolynomial<T,D> res = p;
+    return res *= scalar;
+  }
+
+  template<class T, int D>
+  constexpr FixedPolynomial<T,D> operator/ (const FixedPolynomial<T,D>& p, typename FixedPolynomial<T,D>::real scalar)
+  {
+    FixedPolynomial<T,D> res = p;
+    return res /= scalar;
+  }
+
   template<class T=double>
   class ScaledPolynomial
   {
@@ -232,19 +884,35 @@ namespace cxx {
       m_CoefMultiplier = d;
     }
     
-    double evaluate(double x)
+    double evaluate(double x) const
     {
+      // Horner's rule in y = x/m_VarMultiplier, over the coefficients scaled by
+      // m_VarMultiplier^i / m_CoefMultiplier, from the highest down
+      size_t d = m_Polynomial.degree();
       real y = x / m_VarMultiplier;
-      real sum = 0.0;
-      real yp = 1.0, mp = 1.0/m_CoefMultiplier;
-      for(size_t i=0;i<=m_Polynomial.degree();++i)
+      real mp = 1.0/m_CoefMultiplier;
+      for (size_t i = 0; i < d; ++i) mp*=m_VarMultiplier;
+      real sum = m_Polynomial[d]*mp;
+      for (size_t i = d; i > 0; --i)
       {
-        sum+=m_Polynomial[i]*yp*mp;
-        yp*=y;
-        mp*=m_VarMultiplier;
+        mp/=m_VarMultiplier;
+        sum = sum*y + m_Polynomial[i - 1]*mp;
       }
       return double(m_CoefMultiplier * sum);
     }
+
+    // Evaluates at the n points x into y, and the derivative into dy when given
+    void evaluate(const double* x, double* y, size_t n, double* dy=0) const
+    {
+      std::vector<real> scaled(m_Polynomial.degree() + 1);
+      real mp = 1.0/m_CoefMultiplier;
+      for (size_t i = 0; i < scaled.size(); ++i)
+      {
+        scaled[i] = m_Polynomial[i]*mp;
+        mp*=m_VarMultiplier;
+      }
+      PolynomialHorner<real>::evaluate(scaled.data(), scaled.size(), x, y, n, dy, 1.0/m_VarMultiplier, m_CoefMultiplier);
+    }
   };
 
 
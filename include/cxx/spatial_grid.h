@@ -0,0 +1,307 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <iterator>
+#include <cxx/2dtree.h>
+
+namespace cxx {
+
+// Uniform grid index over two dimensional points, for point sets with roughly
+// uniform density.  Points are counting sorted into cells stored contiguously in
+// CSR form: the points of cell c are at positions [m_CellStart[c], m_CellStart[c+1]).
+// Nearest neighbour searches scan rings of cells around the query, stopping once no
+// unvisited cell can hold a closer point.
+template<class POINT>
+class SpatialGrid
+{
+  typedef SpatialGrid<POINT> self;
+  typedef POINT point;
+  typedef typename POINT::value_type value_type;
+  typedef KDCoords<POINT,2> coords;
+  typedef std::vector<point> point_vec;
+  typedef std::vector<value_type> value_vec;
+  typedef std::vector<size_t> index_vec;
+
+  point_vec  m_Points;
+  value_vec  m_Coords[2];
+  index_vec  m_CellStart;
+  index_vec  m_CellOf;
+  double     m_PointsPerCell;
+  value_type m_Min[2];
+  value_type m_Max[2];
+  double     m_CellSize;
+  int        m_Cells[2];
+
+  class Iterator
+  {
+    const self* m_Grid;
+    size_t      m_Index;
+  public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef point                     value_type;
+    typedef std::ptrdiff_t            difference_type;
+    typedef const point*              pointer;
+    typedef const point&              reference;
+
+    Iterator() : m_Grid(0), m_Index(0) {}
+    Iterator(const self* grid, size_t index) : m_Grid(grid), m_Index(index) {}
+
+    size_t index() const { return m_Index; }
+
+    const point& operator* () const { return m_Grid->m_Points[m_Index]; }
+    const point* operator-> () const { return &(m_Grid->m_Points[m_Index]); }
+    Iterator& operator++()
+    {
+      ++m_Index;
+      return *this;
+    }
+
+    bool operator== (const Iterator& rhs) const { return m_Index == rhs.m_Index; }
+    bool operator!= (const Iterator& rhs) const { return !(*this == rhs); }
+  };
+
+  static double initial_bound() { return std::numeric_limits<float>::max(); }
+
+  int cell_coord(value_type v, int axe) const
+  {
+    double c = std::floor((v - m_Min[axe]) / m_CellSize);
+    if (c < 0) return 0;
+    if (c >= m_Cells[axe]) return m_Cells[axe] - 1;
+    return int(c);
+  }
+
+  size_t cell_of(const point& p) const
+  {
+    return size_t(cell_coord(coords::get(p, 1), 1)) * m_Cells[0] + cell_coord(coords::get(p, 0), 0);
+  }
+
+  // Squared distance from p to the nearest point of cell (x,y)
+  double cell_sqdist(const point& p, int x, int y) const
+  {
+    double res = 0;
+    int c[] = { x, y };
+    for (int axe = 0; axe < 2; ++axe)
+    {
+      double lo = m_Min[axe] + c[axe] * m_CellSize, hi = lo + m_CellSize;
+      double v = coords::get(p, axe);
+      double d = (v < lo ? lo - v : (v > hi ? v - hi : 0));
+      res += d*d;
+    }
+    return res;
+  }
+
+  bool contains(const value_type* lo, const value_type* hi) const
+  {
+    return lo[0] >= m_Min[0] && lo[1] >= m_Min[1] && hi[0] <= m_Max[0] && hi[1] <= m_Max[1];
+  }
+
+  // Whether the current geometry suits points spanning [lo,hi]: they lie within the
+  // bounds and cover at least half of them on each axis
+  bool fits(const value_type* lo, const value_type* hi) const
+  {
+    for (int axe = 0; axe < 2; ++axe)
+      if (2 * double(hi[axe] - lo[axe]) < double(m_Max[axe] - m_Min[axe])) return false;
+    return contains(lo, hi);
+  }
+
+  template<class II>
+  static void bounds(II b, II e, value_type* lo, value_type* hi)
+  {
+    lo[0] = hi[0] = coords::get(*b, 0);
+    lo[1] = hi[1] = coords::get(*b, 1);
+    for (++b; b != e; ++b)
+    {
+      for (int axe = 0; axe < 2; ++axe)
+      {
+        value_type v = coords::get(*b, axe);
+        if (v < lo[axe]) lo[axe] = v;
+        if (v > hi[axe]) hi[axe] = v;
+      }
+    }
+  }
+
+  // Chooses the cell size for n points within [lo,hi], aiming at m_PointsPerCell points per cell
+  void set_geometry(const value_type* lo, const value_type* hi, size_t n)
+  {
+    double w = double(hi[0] - lo[0]), h = double(hi[1] - lo[1]);
+    double extent = std::max(w, h);
+    double cell = std::sqrt(w * h * m_PointsPerCell / n);
+    cell = std::max(cell, extent / n);
+    if (cell <= 0) cell = 1;
+    m_CellSize = cell;
+    for (int axe = 0; axe < 2; ++axe)
+    {
+      m_Min[axe] = lo[axe];
+      m_Max[axe] = hi[axe];
+      m_Cells[axe] = int(std::floor((hi[axe] - lo[axe]) / cell)) + 1;
+    }
+  }
+
+  // Counting sort of [b,e) into the cells of the current geometry
+  template<class II>
+  void fill(II b, II e, size_t n)
+  {
+    size_t cells = size_t(m_Cells[0]) * m_Cells[1];
+    m_CellStart.assign(cells + 1, 0);
+    m_CellOf.resize(n);
+    size_t i = 0;
+    for (II it = b; it != e; ++it, ++i)
+    {
+      m_CellOf[i] = cell_of(*it);
+      ++m_CellStart[m_CellOf[i] + 1];
+    }
+    for (size_t c = 0; c < cells; ++c)
+      m_CellStart[c + 1] += m_CellStart[c];
+    m_Points.resize(n);
+    for (int axe = 0; axe < 2; ++axe) m_Coords[axe].resize(n);
+    // Scatter using the start of each cell as its insertion cursor, then shift back
+    i = 0;
+    for (II it = b; it != e; ++it, ++i)
+    {
+      size_t pos = m_CellStart[m_CellOf[i]]++;
+      m_Points[pos] = *it;
+      m_Coords[0][pos] = coords::get(*it, 0);
+      m_Coords[1][pos] = coords::get(*it, 1);
+    }
+    for (size_t c = cells; c > 0; --c)
+      m_CellStart[c] = m_CellStart[c - 1];
+    m_CellStart[0] = 0;
+  }
+
+  void scan_cell(size_t c, const point& p, Optimizer<size_t>& opt) const
+  {
+    value_type d2[64];
+    for (size_t b = m_CellStart[c], e = m_CellStart[c + 1]; b < e; b += 64)
+    {
+      size_t n = std::min<size_t>(64, e - b);
+      std::fill(d2, d2 + n, value_type(0));
+      kd_accumulate_sqdiff(&m_Coords[0][b], coords::get(p, 0), d2, n);
+      kd_accumulate_sqdiff(&m_Coords[1][b], coords::get(p, 1), d2, n);
+      for (size_t i = 0; i < n; ++i)
+        if (d2[i] < opt.get_best_score()) opt.add(b + i, d2[i]);
+    }
+  }
+
+  void visit(const point& p, int x, int y, Optimizer<size_t>& opt) const
+  {
+    if (x < 0 || y < 0 || x >= m_Cells[0] || y >= m_Cells[1]) return;
+    if (cell_sqdist(p, x, y) > opt.get_best_score()) return;
+    scan_cell(size_t(y) * m_Cells[0] + x, p, opt);
+  }
+
+  void find_nn(const point& p, Optimizer<size_t>& opt) const
+  {
+    if (m_Points.empty()) return;
+    int cx = cell_coord(coords::get(p, 0), 0), cy = cell_coord(coords::get(p, 1), 1);
+    int rings = std::max(std::max(cx, m_Cells[0] - 1 - cx), std::max(cy, m_Cells[1] - 1 - cy));
+    double px = coords::get(p, 0), py = coords::get(p, 1);
+    for (int r = 0; r <= rings; ++r)
+    {
+      if (r == 0) visit(p, cx, cy, opt);
+      else
+      {
+        for (int x = cx - r; x <= cx + r; ++x)
+        {
+          visit(p, x, cy - r, opt);
+          visit(p, x, cy + r, opt);
+        }
+        for (int y = cy - r + 1; y < cy + r; ++y)
+        {
+          visit(p, cx - r, y, opt);
+          visit(p, cx + r, y, opt);
+        }
+      }
+      // Cells beyond ring r are at least this far, on the sides that still have cells
+      double bound = std::numeric_limits<double>::max();
+      if (cx - r > 0) bound = std::min(bound, px - (m_Min[0] + (cx - r) * m_CellSize));
+      if (cx + r < m_Cells[0] - 1) bound = std::min(bound, m_Min[0] + (cx + r + 1) * m_CellSize - px);
+      if (cy - r > 0) bound = std::min(bound, py - (m_Min[1] + (cy - r) * m_CellSize));
+      if (cy + r < m_Cells[1] - 1) bound = std::min(bound, m_Min[1] + (cy + r + 1) * m_CellSize - py);
+      if (bound > 0 && opt.get_best_score() <= bound * bound) break;
+    }
+  }
+public:
+  // points_per_cell sets the target cell occupancy used to choose the cell size
+  SpatialGrid(double points_per_cell=2)
+  : m_PointsPerCell(points_per_cell > 0 ? points_per_cell : 2)
+  , m_CellSize(1)
+  {
+    m_Min[0] = m_Min[1] = m_Max[0] = m_Max[1] = 0;
+    m_Cells[0] = m_Cells[1] = 0;
+  }
+
+  typedef Iterator iterator;
+  iterator begin() const { return Iterator(this, 0); }
+  iterator end()   const { return Iterator(this, size()); }
+
+  size_t size() const { return m_Points.size(); }
+
+  const point& get(size_t index) const { return m_Points[index]; }
+  const point& operator[] (size_t index) const { return get(index); }
+
+  void find_knn(const point& p, int k, iterator* res, double* scores=0) const
+  {
+    Optimizer<size_t> opt(k);
+    opt.set_best_score(initial_bound());
+    find_nn(p, opt);
+    std::vector<size_t> pres(k);
+    std::vector<double> pscores(k);
+    opt.get_best(&pres[0]);
+    opt.get_best_scores(&pscores[0]);
+    for (int i = 0; i < k; ++i)
+      res[i] = (pscores[i] < initial_bound() ? Iterator(this, pres[i]) : end());
+    if (scores)
+      std::copy(pscores.begin(), pscores.end(), scores);
+  }
+
+  iterator find_nn(const point& p) const
+  {
+    Optimizer<size_t> opt;
+    opt.set_best_score(initial_bound());
+    find_nn(p, opt);
+    if (opt.get_best_score() < initial_bound()) return Iterator(this, opt.get_best());
+    return end();
+  }
+
+  // Builds the grid over a copy of [b,e), choosing the cell size from the points' extent
+  template<class II>
+  void build(II b, II e)
+  {
+    size_t n = size_t(std::distance(b, e));
+    if (n == 0)
+    {
+      m_Points.clear();
+      m_Cells[0] = m_Cells[1] = 0;
+      return;
+    }
+    value_type lo[2], hi[2];
+    bounds(b, e, lo, hi);
+    set_geometry(lo, hi, n);
+    fill(b, e, n);
+  }
+
+  // Replaces the points, typically the same set after moving.  All buffers are kept
+  // as long as the number of points does not change much, so a rebuild is one
+  // counting sort pass.  The cell geometry is kept too, unless the points leave the
+  // current bounds or their extent shrinks below half of the bounds on either axis,
+  // which would crowd them into a few oversized cells.
+  template<class II>
+  void rebuild(II b, II e)
+  {
+    size_t n = size_t(std::distance(b, e));
+    if (n == 0 || m_Points.empty() || 2 * n < m_Points.size() || n > 2 * m_Points.size())
+    {
+      build(b, e);
+      return;
+    }
+    value_type lo[2], hi[2];
+    bounds(b, e, lo, hi);
+    if (!fits(lo, hi)) set_geometry(lo, hi, n);
+    fill(b, e, n);
+  }
+};
+
+} // namespace cxx
@@ -3,6 +3,8 @@
 #include <iostream>
 #include <vector>
 #include <list>
+#include <functional>
+#include <algorithm>
 #include <thread>
 #include <mutex>
 #include <sstream>
@@ -45,6 +47,10 @@ public:
 
   bool initialized() const { return !m_Pool.empty(); }
 
+  size_t threads() const { return m_Pool.size(); }
+
+  static bool is_worker_thread() { return worker_flag(); }
+
   void start(size_t size, size_t max_queue_size=0)
   {
     if (m_Pool.empty())
@@ -161,9 +167,16 @@ private:
   TaskManager(const TaskManager&) {}
   TaskManager& operator= (const TaskManager&) { return *this; }
 
+  static bool& worker_flag()
+  {
+    static thread_local bool flag = false;
+    return flag;
+  }
+
   void thread_main()
   {
     //auto id=std::this_thread::get_id();
+    worker_flag() = true;
     while (!m_Terminate)
     {
       Task task;
@@ -220,6 +233,63 @@ inline void add_task(callable c, const xstring& group="") { cxx::TaskManager::in
 inline void call_task(callable c) { c(); }
 inline void add_task(bool parallel, callable c, const xstring& group="") { if (parallel) add_task(c,group); else c(); }
 
+// Split [0,n) into one contiguous chunk per pool thread (each at least min_chunk long),
+// run func(begin,end) on every chunk and wait for all of them to finish.
+// The whole range is processed inline when there is no pool, or when called from a worker.
+template<class F>
+inline void parallel_chunks(size_t n, size_t min_chunk, F func)
+{
+  TaskManager* tm = TaskManager::instance();
+  size_t chunk = std::max<size_t>(std::max<size_t>(min_chunk, 1), (n + tm->threads() - 1) / std::max<size_t>(tm->threads(), 1));
+  if (!tm->initialized() || TaskManager::is_worker_thread() || chunk >= n)
+  {
+    if (n > 0) func(size_t(0), n);
+    return;
+  }
+  xstring group;
+  group << "parallel_chunks_" << (const void*)(&func);
+  for (size_t b = 0; b < n; b += chunk)
+  {
+    size_t e = std::min(n, b + chunk);
+    tm->add_task([func, b, e]() { func(b, e); }, group);
+  }
+  tm->group_wait(group);
+}
+
+// Reduction over [0,n) on the chunks of parallel_chunks.  Every chunk starts from its
+// own copy of init, passed to func(begin,end,local).  The chunk results are then folded
+// with combine(acc,local) in range order, so the result does not depend on scheduling.
+template<class T, class F, class C>
+inline T parallel_reduce(size_t n, size_t min_chunk, const T& init, F func, C combine)
+{
+  typedef std::pair<size_t,T> partial;
+  std::vector<partial> partials;
+  std::mutex mutex;
+  parallel_chunks(n, min_chunk, [&init, &func, &partials, &mutex](size_t b, size_t e)
+  {
+    T local = init;
+    func(b, e, local);
+    std::lock_guard<std::mutex> lock(mutex);
+    partials.push_back(partial(b, std::move(local)));
+  });
+  if (partials.empty()) return init;
+  std::sort(partials.begin(), partials.end(), [](const partial& a, const partial& b) { return a.first < b.first; });
+  T res = std::move(partials[0].second);
+  for (size_t i = 1; i < partials.size(); ++i)
+    combine(res, partials[i].second);
+  return res;
+}
+
+// Parallel top-k scan: func(begin,end,local) adds the candidates of its chunk to a
+// thread local copy of opt, and the copies are merged back into opt.  opt should hold
+// no results yet, only the bound given by set_best_score.  Works with any optimizer
+// providing merge (Optimizer, HeapOptimizer, FixedOptimizer).
+template<class OPT, class F>
+inline void parallel_optimize(size_t n, size_t min_chunk, OPT& opt, F func)
+{
+  opt = parallel_reduce(n, min_chunk, opt, func, [](OPT& acc, const OPT& local) { acc.merge(local); });
+}
+
 template<class T>
 inline void sync_print(const T& t)
 {
@@ -43,10 +43,10 @@ namespace cxx {
 
     operator const value_type* () const { return parent::c_str(); }
 
-    template<typename T>
-    T as() const
+    template<typename U>
+    U as() const
     {
-        T res;
+        U res;
         std::istringstream is(*this);
         is >> res;
         return res;